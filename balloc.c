@@ -0,0 +1,932 @@
+/*
+ * file:        balloc.c
+ * description: free block allocator over the block bitmaps
+ *
+ * The disk is divided into groups of superblock.group_blocks blocks (by
+ * default as many as one bitmap block has bits), each with a bitmap
+ * block of its own: block 1 for group 0, as in the original one-bitmap
+ * format, and the group's first block for every other group. So an
+ * image of up to 32K blocks has a single group and the old layout, and
+ * an image can be grown by extending it with zeroes and raising
+ * disk_size.
+ *
+ * Groups are loaded lazily. At mount only each group's count of free
+ * blocks is needed; the first allocation or free that touches a group
+ * copies its bitmap into memory and builds an index of its free space:
+ * a sorted array of free extents (runs of free blocks), found by
+ * scanning the bitmap 64 bits at a time with ctz, and kept in step with
+ * the bitmap by every allocation and free.
+ *
+ * Each allocation names a goal block - typically the block after a
+ * file's last data block, or its parent directory's inode - and is
+ * placed to keep files contiguous:
+ *   1. whatever is free starting exactly at the goal;
+ *   2. otherwise the first free extent after the goal long enough for
+ *      the rest of the request, going on through the following groups
+ *      and wrapping around the disk; groups with too few free blocks
+ *      are skipped without being loaded;
+ *   3. failing that, the longest free extent, and repeat.
+ * A negative goal means no preference; the search then starts where the
+ * previous one ended (next-fit).
+ *
+ * File data is allocated with balloc_alloc_file, which opens a
+ * reservation window for the file: a run of free blocks held out of the
+ * extent index, that the file's following appends are served from. Files
+ * written side by side thus each fill their own window instead of taking
+ * turns with the next free block. A file that uses up its window gets
+ * one twice the size, up to RESV_MAX_WINDOW. Reservations live in memory
+ * only, are recycled LRU, and are all given back when the disk is short
+ * of unreserved space.
+ *
+ * The number of free blocks is kept up to date, so a request that cannot
+ * be satisfied fails without a search and statfs needs no bitmap scan.
+ * At unmount the counts are saved in the superblock; the next mount
+ * takes them from there if the unmount was clean, and only after a
+ * crash (or for groups the superblock has no room for) reads and
+ * popcounts the bitmaps.
+ *
+ * Every change is written back before returning, one bitmap block for
+ * each group that changed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "balloc.h"
+#include "cache.h"
+
+#define GROUP_MAX_BLOCKS (FS_BLOCK_SIZE * 8)
+#define EXTENTS_INIT 64         /* index entries allocated per group at load */
+#define RESV_WINDOW 16          /* blocks held past a file's last allocation */
+#define RESV_MAX_WINDOW 256
+#define RESV_SLOTS 64
+
+struct free_extent {
+    int start;
+    int len;
+};
+
+struct group {
+    uint64_t *bitmap;           /* FS_BLOCK_SIZE bytes, NULL until loaded */
+    struct free_extent *extents;    /* sorted, never adjacent */
+    int nextents;
+    int maxextents;
+    int free;                   /* free blocks, known from mount on */
+    int dirty;                  /* bitmap must be written back */
+};
+
+struct reservation {
+    int owner;                  /* inode number, 0 if the slot is unused */
+    int start;
+    int len;                    /* blocks still held */
+    int window;                 /* size of the last window opened */
+    uint64_t used;              /* LRU stamp */
+};
+
+static struct group *groups;
+static int ngroups;
+static int group_blocks;
+static int *dirty_groups;       /* groups with dirty set, ndirty of them */
+static int ndirty;
+static int disk_blocks;
+static int free_blocks;
+static int cursor;              /* block */
+static struct reservation resv[RESV_SLOTS];
+static int reserved_blocks;
+static uint64_t resv_clock;
+static struct balloc_stats stats;
+static pthread_mutex_t ba_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* block holding the bitmap of group 'g'
+ */
+static int bitmap_lba(int g)
+{
+    return (g == 0) ? 1 : g * group_blocks;
+}
+
+static int group_len(int g)
+{
+    int len = disk_blocks - g * group_blocks;
+    return (len < group_blocks) ? len : group_blocks;
+}
+
+/* free blocks in word 'w' of group 'g's bitmap, leaving out bits past
+ * the end of the disk and the group's own bitmap block, which is never
+ * free even in a freshly grown image whose bitmap is still all zeroes
+ */
+static uint64_t free_bits(int g, const uint64_t *bitmap, int w)
+{
+    uint64_t used = bitmap[w];
+    int valid = group_len(g) - w * 64;
+    if (valid < 64)
+    {
+        used |= (valid <= 0) ? ~0ULL : ~0ULL << valid;
+    }
+    if (g > 0 && w == 0)
+    {
+        used |= 1;
+    }
+    return ~used;
+}
+
+static int bit_test(const struct group *g, int block)
+{
+    int bit = block % group_blocks;
+    return (g->bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void mark_dirty(int g)
+{
+    if (!groups[g].dirty)
+    {
+        groups[g].dirty = 1;
+        dirty_groups[ndirty++] = g;
+    }
+}
+
+/* index of the last extent starting at or before 'block', or -1
+ */
+static int extent_find(const struct group *g, int block)
+{
+    int lo = 0, hi = g->nextents - 1, found = -1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (g->extents[mid].start <= block)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/* make sure the index of 'g' can take one more extent. Done before
+ * anything is changed, so the index never has to grow half way through
+ */
+static int extent_room(struct group *g)
+{
+    if (g->nextents < g->maxextents)
+    {
+        return 0;
+    }
+    struct free_extent *extents = realloc(g->extents, 2 * g->maxextents * sizeof(*extents));
+    if (extents == NULL)
+    {
+        return -ENOMEM;
+    }
+    g->extents = extents;
+    g->maxextents *= 2;
+    return 0;
+}
+
+static void extent_insert(struct group *g, int i, int start, int len)
+{
+    memmove(&g->extents[i + 1], &g->extents[i], sizeof(g->extents[0]) * (g->nextents - i));
+    g->extents[i].start = start;
+    g->extents[i].len = len;
+    g->nextents++;
+}
+
+static void extent_delete(struct group *g, int i)
+{
+    memmove(&g->extents[i], &g->extents[i + 1], sizeof(g->extents[0]) * (g->nextents - i - 1));
+    g->nextents--;
+}
+
+/* remove [start, start+len) - which lies inside extent 'i' - from the
+ * index
+ */
+static void extent_take(struct group *g, int i, int start, int len)
+{
+    struct free_extent *e = &g->extents[i];
+    int end = e->start + e->len;
+    if (start == e->start && len == e->len)
+    {
+        extent_delete(g, i);
+    }
+    else if (start == e->start)
+    {
+        e->start += len;
+        e->len -= len;
+    }
+    else if (start + len == end)
+    {
+        e->len -= len;
+    }
+    else
+    {
+        e->len = start - e->start;
+        extent_insert(g, i + 1, start + len, end - start - len);
+    }
+}
+
+/* add free run [start, start+len) to the index, merging with its
+ * neighbours
+ */
+static void extent_give(struct group *g, int start, int len)
+{
+    int i = extent_find(g, start);
+    int joinPrev = (i >= 0 && g->extents[i].start + g->extents[i].len == start);
+    int joinNext = (i + 1 < g->nextents && g->extents[i + 1].start == start + len);
+    if (joinPrev && joinNext)
+    {
+        g->extents[i].len += len + g->extents[i + 1].len;
+        extent_delete(g, i + 1);
+    }
+    else if (joinPrev)
+    {
+        g->extents[i].len += len;
+    }
+    else if (joinNext)
+    {
+        g->extents[i + 1].start -= len;
+        g->extents[i + 1].len += len;
+    }
+    else
+    {
+        extent_insert(g, i + 1, start, len);
+    }
+}
+
+static void mark_used(int start, int len)
+{
+    int gi = start / group_blocks;
+    struct group *g = &groups[gi];
+    for (int b = start; b < start + len; b++)
+    {
+        int bit = b % group_blocks;
+        g->bitmap[bit / 64] |= 1ULL << (bit % 64);
+    }
+    g->free -= len;
+    free_blocks -= len;
+    mark_dirty(gi);
+}
+
+/* bring group 'gi' into memory: read its bitmap and index its free
+ * extents, walking each word one run at a time - ctz finds where each
+ * run of free or used bits ends
+ */
+static int group_load(int gi)
+{
+    struct group *g = &groups[gi];
+    if (g->bitmap != NULL)
+    {
+        return 0;
+    }
+
+    int status;
+    uint64_t *bitmap = malloc(FS_BLOCK_SIZE);
+    struct free_extent *extents = malloc(EXTENTS_INIT * sizeof(*extents));
+    if (bitmap == NULL || extents == NULL)
+    {
+        free(bitmap);
+        free(extents);
+        return -ENOMEM;
+    }
+    if ((status = cache_read_meta(bitmap, bitmap_lba(gi))) < 0)
+    {
+        free(bitmap);
+        free(extents);
+        return status;
+    }
+    g->extents = extents;
+    g->maxextents = EXTENTS_INIT;
+    g->nextents = 0;
+
+    int base = gi * group_blocks, nfree = 0, runStart = -1;
+    for (int w = 0; w < DIV_ROUND_UP(group_len(gi), 64); w++)
+    {
+        uint64_t avail = free_bits(gi, bitmap, w);
+        nfree += __builtin_popcountll(avail);
+        int bit = 0;
+        while (bit < 64)
+        {
+            uint64_t rest = avail >> bit;
+            int n;
+            if (runStart < 0)
+            {
+                if (rest == 0)
+                {
+                    break;
+                }
+                n = __builtin_ctzll(rest);
+                runStart = base + w * 64 + bit + n;
+            }
+            else
+            {
+                n = (~rest == 0) ? 64 - bit : __builtin_ctzll(~rest);
+                if (bit + n < 64)
+                {
+                    if ((status = extent_room(g)) < 0)
+                    {
+                        free(bitmap);
+                        free(g->extents);
+                        g->extents = NULL;
+                        return status;
+                    }
+                    extent_insert(g, g->nextents, runStart, base + w * 64 + bit + n - runStart);
+                    runStart = -1;
+                }
+            }
+            bit += n;
+        }
+    }
+    if (runStart >= 0)
+    {
+        if ((status = extent_room(g)) < 0)
+        {
+            free(bitmap);
+            free(g->extents);
+            g->extents = NULL;
+            return status;
+        }
+        extent_insert(g, g->nextents, runStart, base + group_len(gi) - runStart);
+    }
+
+    g->bitmap = bitmap;
+    if (gi > 0 && !(bitmap[0] & 1))
+    {
+        bitmap[0] |= 1;
+        mark_dirty(gi);
+    }
+    free_blocks += nfree - g->free;
+    g->free = nfree;
+    return 0;
+}
+
+/* set bits in 'n' words. Four independent sums keep the popcounts from
+ * waiting on each other; on x86-64 a copy built for the POPCNT
+ * instruction is picked at load time if the CPU has it
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target_clones("popcnt", "default")))
+#endif
+static int popcount_words(const uint64_t *words, int n)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    int i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        c0 += __builtin_popcountll(words[i]);
+        c1 += __builtin_popcountll(words[i + 1]);
+        c2 += __builtin_popcountll(words[i + 2]);
+        c3 += __builtin_popcountll(words[i + 3]);
+    }
+    for (; i < n; i++)
+    {
+        c0 += __builtin_popcountll(words[i]);
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+/* free blocks in group 'gi', from its bitmap block, without loading it
+ */
+static int group_count(int gi)
+{
+    uint64_t buf[FS_BLOCK_SIZE / 8];
+    const uint64_t *bitmap;
+    if ((bitmap = cache_peek_meta(buf, bitmap_lba(gi))) == NULL)
+    {
+        return -EIO;
+    }
+    int len = group_len(gi), full = len / 64;
+    int used = popcount_words(bitmap, full);
+    if (len % 64 != 0)
+    {
+        used += __builtin_popcountll(~free_bits(gi, bitmap, full) & ~(~0ULL << (len % 64)));
+    }
+    if (gi > 0 && !(bitmap[0] & 1))
+    {
+        used++;
+    }
+    return len - used;
+}
+
+/* write back the bitmap of every group changed since the last call
+ */
+static int groups_flush(void)
+{
+    int status = 0, val;
+    for (int i = 0; i < ndirty; i++)
+    {
+        struct group *g = &groups[dirty_groups[i]];
+        if ((val = cache_write_meta(g->bitmap, bitmap_lba(dirty_groups[i]))) < 0)
+        {
+            status = val;
+        }
+        g->dirty = 0;
+    }
+    ndirty = 0;
+    return status;
+}
+
+/* where to allocate up to 'need' blocks when aiming for 'pos': free
+ * space right at 'pos', else the first extent past it that holds them
+ * all (wrapping), else the longest extent there is. Sets *gp and *start
+ * and returns the extent index, or -errno. Some block must be free
+ * outside the reservations
+ */
+static int find_run(int pos, int need, struct group **gp, int *start)
+{
+    pos = (pos < disk_blocks) ? pos : 0;
+    int gi = pos / group_blocks, status;
+    if ((status = group_load(gi)) < 0)
+    {
+        return status;
+    }
+    struct group *g = &groups[gi];
+    int i = extent_find(g, pos);
+    if (i >= 0 && pos < g->extents[i].start + g->extents[i].len)
+    {
+        *gp = g;
+        *start = pos;
+        return i;
+    }
+
+    // the rest of this group, the groups after it, then its beginning
+    for (int k = 0; k <= ngroups; k++)
+    {
+        int gk = (gi + k) % ngroups;
+        g = &groups[gk];
+        if (g->free < need)
+        {
+            continue;
+        }
+        if ((status = group_load(gk)) < 0)
+        {
+            return status;
+        }
+        int from = (k == 0) ? i + 1 : 0;
+        int to = (k == ngroups) ? i + 1 : g->nextents;
+        for (int j = from; j < to; j++)
+        {
+            if (g->extents[j].len >= need)
+            {
+                *gp = g;
+                *start = g->extents[j].start;
+                return j;
+            }
+        }
+    }
+
+    int best = -1;
+    for (int gk = 0; gk < ngroups; gk++)
+    {
+        g = &groups[gk];
+        if (g->free == 0)
+        {
+            continue;
+        }
+        if ((status = group_load(gk)) < 0)
+        {
+            return status;
+        }
+        for (int j = 0; j < g->nextents; j++)
+        {
+            if (best < 0 || g->extents[j].len > (*gp)->extents[best].len)
+            {
+                best = j;
+                *gp = g;
+            }
+        }
+    }
+    if (best < 0)
+    {
+        return -ENOSPC;
+    }
+    *start = (*gp)->extents[best].start;
+    return best;
+}
+
+static int is_free(int block)
+{
+    struct group *g = &groups[block / group_blocks];
+    if (group_load(block / group_blocks) < 0)
+    {
+        return 0;
+    }
+    int i = extent_find(g, block);
+    return i >= 0 && block < g->extents[i].start + g->extents[i].len;
+}
+
+/* return a reservation's blocks to the extent index. They were taken out
+ * of it whole, so giving them back never needs more room than that left
+ */
+static void resv_release(struct reservation *r)
+{
+    if (r->len > 0)
+    {
+        struct group *g = &groups[r->start / group_blocks];
+        if (extent_room(g) == 0)
+        {
+            extent_give(g, r->start, r->len);
+        }
+    }
+    reserved_blocks -= r->len;
+    r->len = 0;
+}
+
+/* the reservation slot of 'owner', recycling the least recently used
+ * one if it has none
+ */
+static struct reservation *resv_slot(int owner)
+{
+    struct reservation *r = &resv[0];
+    for (int i = 0; i < RESV_SLOTS; i++)
+    {
+        if (resv[i].owner == owner)
+        {
+            return &resv[i];
+        }
+        if (resv[i].used < r->used)
+        {
+            r = &resv[i];
+        }
+    }
+    resv_release(r);
+    r->owner = owner;
+    r->window = 0;
+    return r;
+}
+
+/* hold up to 'want' free blocks near 'goal' in 'r'
+ */
+static int resv_fill(struct reservation *r, int goal, int want)
+{
+    struct group *g;
+    int start, status, i = find_run(goal, want, &g, &start);
+    if (i < 0)
+    {
+        return i;
+    }
+    if ((status = extent_room(g)) < 0)
+    {
+        return status;
+    }
+    int len = g->extents[i].start + g->extents[i].len - start;
+    len = (len < want) ? len : want;
+    extent_take(g, i, start, len);
+    r->start = start;
+    r->len = len;
+    reserved_blocks += len;
+    return 0;
+}
+
+/* clear the bits of 'blocks' and give them back to the extent index, a
+ * run of consecutive blocks at a time. Blocks that are already free or
+ * off the disk are skipped. Returns the number freed, or -errno
+ */
+static int release_blocks(const int *blocks, int n)
+{
+    int freed = 0, status;
+    for (int i = 0; i < n;)
+    {
+        int b = blocks[i], gi = b / group_blocks, len = 1;
+        if (b <= 0 || b >= disk_blocks || b == bitmap_lba(gi))
+        {
+            i++;
+            continue;
+        }
+        if ((status = group_load(gi)) < 0 || (status = extent_room(&groups[gi])) < 0)
+        {
+            return status;
+        }
+        struct group *g = &groups[gi];
+        if (!bit_test(g, b))
+        {
+            i++;
+            continue;
+        }
+        while (i + len < n && blocks[i + len] == b + len && (b + len) % group_blocks != 0 &&
+               bit_test(g, b + len))
+        {
+            len++;
+        }
+        for (int k = b; k < b + len; k++)
+        {
+            int bit = k % group_blocks;
+            g->bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+        }
+        extent_give(g, b, len);
+        g->free += len;
+        free_blocks += len;
+        mark_dirty(gi);
+        freed += len;
+        i += len;
+    }
+    return freed;
+}
+
+/* take the free counts of the groups from a cleanly unmounted
+ * superblock, for as many groups as it has room for. Returns 0, or -1 if
+ * they cannot be trusted
+ */
+static int groups_restore(const struct fs_super *sb)
+{
+    if (sb->state != FS_STATE_CLEAN)
+    {
+        return -1;
+    }
+    int total = 0;
+    for (int g = 0; g < ngroups && g < FS_SUPER_GROUPS; g++)
+    {
+        if (sb->group_free[g] > group_len(g))
+        {
+            return -1;
+        }
+        groups[g].free = sb->group_free[g];
+        total += groups[g].free;
+    }
+    free_blocks = total;
+    return 0;
+}
+
+/* count the free blocks of groups 'first' on, reading their bitmap
+ * blocks ahead in batches
+ */
+static int groups_count(int first)
+{
+    uint32_t lbas[64];
+    for (int g = first; g < ngroups; g++)
+    {
+        if ((g - first) % 64 == 0)
+        {
+            int n = (ngroups - g < 64) ? ngroups - g : 64;
+            for (int i = 0; i < n; i++)
+            {
+                lbas[i] = bitmap_lba(g + i);
+            }
+            cache_prefetch(lbas, n);
+        }
+        if ((groups[g].free = group_count(g)) < 0)
+        {
+            int status = groups[g].free;
+            groups[g].free = 0;
+            return status;
+        }
+        free_blocks += groups[g].free;
+        stats.groups_counted++;
+    }
+    return 0;
+}
+
+/* set up the groups of the disk described by 'sb'. The free count of
+ * each group comes from the superblock after a clean unmount, and from
+ * a scan of its bitmap otherwise
+ */
+int balloc_init(const struct fs_super *sb)
+{
+    int nblocks = sb->disk_size, groupBlocks = sb->group_blocks;
+    if (groupBlocks == 0)
+    {
+        groupBlocks = GROUP_MAX_BLOCKS;
+    }
+    if (groupBlocks % 64 != 0 || groupBlocks > GROUP_MAX_BLOCKS || nblocks <= 2)
+    {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ba_lock);
+    for (int g = 0; g < ngroups; g++)
+    {
+        free(groups[g].bitmap);
+        free(groups[g].extents);
+    }
+    free(groups);
+    free(dirty_groups);
+    disk_blocks = nblocks;
+    group_blocks = groupBlocks;
+    ngroups = DIV_ROUND_UP(nblocks, groupBlocks);
+    groups = calloc(ngroups, sizeof(*groups));
+    dirty_groups = malloc(ngroups * sizeof(int));
+    ndirty = 0;
+    free_blocks = 0;
+    if (groups == NULL || dirty_groups == NULL)
+    {
+        ngroups = 0;
+        pthread_mutex_unlock(&ba_lock);
+        return -ENOMEM;
+    }
+    memset(&stats, 0, sizeof(stats));
+    // the saved counts must add up to the saved total, or it is a rescan
+    int status;
+    if (groups_restore(sb) < 0 || groups_count(FS_SUPER_GROUPS) < 0 ||
+        free_blocks != sb->free_blocks)
+    {
+        free_blocks = 0;
+        stats.groups_counted = 0;
+        status = groups_count(0);
+    }
+    else
+    {
+        status = 0;
+    }
+    cursor = 0;
+    memset(resv, 0, sizeof(resv));
+    reserved_blocks = 0;
+    pthread_mutex_unlock(&ba_lock);
+    return status;
+}
+
+/* record the free blocks of the disk and of each group in 'sb', for the
+ * next mount to trust if the unmount completes
+ */
+void balloc_summarize(struct fs_super *sb)
+{
+    pthread_mutex_lock(&ba_lock);
+    sb->free_blocks = free_blocks;
+    for (int g = 0; g < FS_SUPER_GROUPS; g++)
+    {
+        sb->group_free[g] = (g < ngroups) ? groups[g].free : 0;
+    }
+    pthread_mutex_unlock(&ba_lock);
+}
+
+/* caller holds ba_lock. 'owner' is 0 for allocations that should not
+ * use a reservation window
+ */
+static int alloc_blocks(int owner, int goal, int n, int *blocks)
+{
+    int found = 0, status = 0;
+    if (n > free_blocks)
+    {
+        return -ENOSPC;
+    }
+
+    int pos = (goal >= 0 && goal < disk_blocks) ? goal : cursor;
+    if (owner > 0)
+    {
+        struct reservation *r = resv_slot(owner);
+        r->used = ++resv_clock;
+        // continuing the file in place beats its window
+        if (r->len > 0 && r->start != pos && is_free(pos))
+        {
+            resv_release(r);
+        }
+        if (r->len == 0 && n - found <= free_blocks - reserved_blocks)
+        {
+            r->window = (r->window == 0) ? RESV_WINDOW : r->window * 2;
+            r->window = (r->window < RESV_MAX_WINDOW) ? r->window : RESV_MAX_WINDOW;
+            int want = n + r->window;
+            if ((status = resv_fill(r, pos, (want < free_blocks - reserved_blocks) ? want : free_blocks - reserved_blocks)) < 0)
+            {
+                return status;
+            }
+        }
+        found = (r->len < n) ? r->len : n;
+        for (int b = r->start; b < r->start + found; b++)
+        {
+            blocks[b - r->start] = b;
+        }
+        if (found > 0)
+        {
+            mark_used(r->start, found);
+            r->start += found;
+            r->len -= found;
+            reserved_blocks -= found;
+            pos = r->start;
+            stats.runs++;
+        }
+    }
+    if (n - found > free_blocks - reserved_blocks)
+    {
+        for (int k = 0; k < RESV_SLOTS; k++)
+        {
+            resv_release(&resv[k]);
+        }
+    }
+
+    while (found < n)
+    {
+        struct group *g;
+        int need = n - found, start;
+        int i = find_run(pos, need, &g, &start);
+        if (i < 0 || (status = extent_room(g)) < 0)
+        {
+            // give back what this call took, so it stays all or nothing
+            status = (i < 0) ? i : status;
+            release_blocks(blocks, found);
+            groups_flush();
+            return status;
+        }
+        int len = g->extents[i].start + g->extents[i].len - start;
+        len = (len < need) ? len : need;
+        extent_take(g, i, start, len);
+        mark_used(start, len);
+        for (int b = start; b < start + len; b++)
+        {
+            blocks[found++] = b;
+        }
+        stats.runs++;
+        pos = start + len;
+    }
+    if (blocks[0] == goal)
+    {
+        stats.goal_hits++;
+    }
+    cursor = (pos < disk_blocks) ? pos : 0;
+    stats.allocs += n;
+    return groups_flush();
+}
+
+/* allocate 'n' blocks as close to 'goal' and as contiguous as possible,
+ * storing their numbers in 'blocks'. All or nothing: returns 0, or
+ * -ENOSPC without allocating anything
+ */
+int balloc_alloc(int goal, int n, int *blocks)
+{
+    pthread_mutex_lock(&ba_lock);
+    int status = alloc_blocks(0, goal, n, blocks);
+    pthread_mutex_unlock(&ba_lock);
+    return status;
+}
+
+/* the same, for data of file 'inum': 'goal' should be the block after
+ * the file's last one. Blocks are taken from the file's reservation
+ * window, which is opened or grown as needed
+ */
+int balloc_alloc_file(int inum, int goal, int n, int *blocks)
+{
+    pthread_mutex_lock(&ba_lock);
+    int status = alloc_blocks(inum, goal, n, blocks);
+    pthread_mutex_unlock(&ba_lock);
+    return status;
+}
+
+/* drop the reservation window of file 'inum', which is going away
+ */
+void balloc_discard(int inum)
+{
+    pthread_mutex_lock(&ba_lock);
+    for (int i = 0; i < RESV_SLOTS; i++)
+    {
+        if (resv[i].owner == inum)
+        {
+            resv_release(&resv[i]);
+            resv[i].owner = 0;
+            resv[i].used = 0;
+        }
+    }
+    pthread_mutex_unlock(&ba_lock);
+}
+
+/* return 'n' blocks to the free pool. Blocks that are already free or
+ * off the disk are ignored
+ */
+int balloc_free(const int *blocks, int n)
+{
+    pthread_mutex_lock(&ba_lock);
+    int status = release_blocks(blocks, n);
+    if (status > 0)
+    {
+        stats.frees += status;
+    }
+    int val = groups_flush();
+    pthread_mutex_unlock(&ba_lock);
+    return (status < 0) ? status : val;
+}
+
+int balloc_free_count(void)
+{
+    pthread_mutex_lock(&ba_lock);
+    int n = free_blocks;
+    pthread_mutex_unlock(&ba_lock);
+    return n;
+}
+
+void balloc_get_stats(struct balloc_stats *st)
+{
+    pthread_mutex_lock(&ba_lock);
+    memcpy(st, &stats, sizeof(*st));
+    st->free = free_blocks;
+    st->free_extents = 0;
+    st->largest_free = 0;
+    st->groups = ngroups;
+    st->groups_loaded = 0;
+    for (int g = 0; g < ngroups; g++)
+    {
+        if (groups[g].bitmap == NULL)
+        {
+            continue;
+        }
+        st->groups_loaded++;
+        st->free_extents += groups[g].nextents;
+        for (int i = 0; i < groups[g].nextents; i++)
+        {
+            if (groups[g].extents[i].len > st->largest_free)
+            {
+                st->largest_free = groups[g].extents[i].len;
+            }
+        }
+    }
+    st->cursor = cursor;
+    st->reserved = reserved_blocks;
+    pthread_mutex_unlock(&ba_lock);
+}
@@ -0,0 +1,36 @@
+/*
+ * file:        balloc.h
+ * description: free block allocator over the block bitmaps
+ */
+#ifndef __BALLOC_H__
+#define __BALLOC_H__
+
+#include <stdint.h>
+
+#include "fs5600.h"
+
+struct balloc_stats {
+    uint64_t allocs;            /* blocks handed out */
+    uint64_t frees;
+    uint64_t runs;              /* contiguous runs they were handed out in */
+    uint64_t goal_hits;         /* allocations that started at their goal */
+    int      free;              /* blocks currently free */
+    int      free_extents;      /* runs of free blocks */
+    int      largest_free;      /* blocks in the longest one */
+    int      reserved;          /* free, but held for files being written */
+    int      cursor;            /* where a search without a goal starts */
+    int      groups;            /* bitmap groups on the disk */
+    int      groups_loaded;     /* ... brought into memory so far */
+    int      groups_counted;    /* ... whose bitmap was scanned at mount */
+};
+
+int balloc_init(const struct fs_super *sb);
+void balloc_summarize(struct fs_super *sb);
+int balloc_alloc(int goal, int n, int *blocks);
+int balloc_alloc_file(int inum, int goal, int n, int *blocks);
+void balloc_discard(int inum);
+int balloc_free(const int *blocks, int n);
+int balloc_free_count(void);
+void balloc_get_stats(struct balloc_stats *st);
+
+#endif
@@ -0,0 +1,758 @@
+/*
+ * file:        cache.c
+ * description: fixed-memory block buffer cache
+ *
+ * Blocks are cached by LBA in a set of independently locked shards (LBA
+ * hash picks the shard), so FUSE threads working on different blocks
+ * rarely contend. Each shard owns a fixed number of block-sized slots
+ * and replaces them with the CLOCK algorithm.
+ *
+ * By default the cache is write-through: writes go to disk first and
+ * then update the cached copy. In write-back mode writes only dirty the
+ * cached copy, so repeated writes to the same block (the bitmap, an
+ * inode being appended to) coalesce in memory. Dirty blocks go to disk,
+ * sorted by LBA, when a shard is more than half dirty, when the flusher
+ * thread wakes up, or when cache_sync() is called.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fs5600.h"
+#include "cache.h"
+
+#define CACHE_SHARDS 16         /* power of 2 */
+#define CACHE_FLUSH_INTERVAL 5  /* seconds between write-back passes */
+
+struct cache_slot {
+    int      lba;               /* -1 if empty */
+    int      next;              /* hash chain, -1 terminates */
+    uint8_t  ref;               /* CLOCK reference bit */
+    uint8_t  dirty;             /* newer than the disk copy */
+    uint8_t  ra;                /* read ahead, not yet used */
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    int nslots;
+    int hand;                   /* CLOCK hand */
+    int bucket_mask;
+    int *buckets;               /* heads of hash chains */
+    struct cache_slot *slots;
+    char *data;                 /* nslots * fs_block_size */
+    uint64_t wgen;              /* bumped by every write to the shard */
+    int ndirty;
+    uint64_t hits, misses, evictions, writebacks;
+    uint64_t prefetched, ra_hits;
+    uint64_t bypassed;
+};
+
+static size_t budget = CACHE_DEFAULT_BUDGET;
+static int enabled;
+static int writeback;
+static struct cache_shard shards[CACHE_SHARDS];
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+} flusher = {.lock = PTHREAD_MUTEX_INITIALIZER,
+             .cond = PTHREAD_COND_INITIALIZER};
+
+static inline uint32_t lba_hash(int lba)
+{
+    return (uint32_t)lba * 0x9E3779B1u;
+}
+
+static inline struct cache_shard *shard_of(int lba)
+{
+    return &shards[lba_hash(lba) >> 28 & (CACHE_SHARDS - 1)];
+}
+
+static inline int *bucket_of(struct cache_shard *sh, int lba)
+{
+    return &sh->buckets[lba_hash(lba) & sh->bucket_mask];
+}
+
+static inline char *slot_data(struct cache_shard *sh, int idx)
+{
+    return sh->data + ((size_t)idx << fs_block_shift);
+}
+
+/* slot index holding 'lba', or -1. Caller holds the shard lock
+ */
+static int shard_lookup(struct cache_shard *sh, int lba)
+{
+    for (int idx = *bucket_of(sh, lba); idx >= 0; idx = sh->slots[idx].next)
+    {
+        if (sh->slots[idx].lba == lba)
+        {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void shard_unhash(struct cache_shard *sh, int idx)
+{
+    int *pidx = bucket_of(sh, sh->slots[idx].lba);
+    while (*pidx != idx)
+    {
+        pidx = &sh->slots[*pidx].next;
+    }
+    *pidx = sh->slots[idx].next;
+}
+
+/* claim a slot for 'lba', evicting with CLOCK if necessary. Caller holds
+ * the shard lock and has checked that 'lba' is not already cached. Dirty
+ * slots are never evicted; shard_put keeps at least half the slots clean.
+ */
+static int shard_claim(struct cache_shard *sh, int lba)
+{
+    int idx;
+    for (;;)
+    {
+        idx = sh->hand;
+        sh->hand = (sh->hand + 1) % sh->nslots;
+        if (sh->slots[idx].lba < 0)
+        {
+            break;
+        }
+        if (sh->slots[idx].dirty)
+        {
+            continue;
+        }
+        if (!sh->slots[idx].ref)
+        {
+            shard_unhash(sh, idx);
+            sh->slots[idx].ra = 0;
+            sh->evictions++;
+            break;
+        }
+        sh->slots[idx].ref = 0;
+    }
+    int *head = bucket_of(sh, lba);
+    sh->slots[idx].lba = lba;
+    sh->slots[idx].ref = 1;
+    sh->slots[idx].next = *head;
+    *head = idx;
+    return idx;
+}
+
+static int iov_cmp(const void *a, const void *b)
+{
+    return ((const struct block_iov *)a)->lba - ((const struct block_iov *)b)->lba;
+}
+
+/* write every dirty block of the shard to disk, in LBA order so that
+ * neighbouring blocks go out as one request. Caller holds the shard lock.
+ */
+static int shard_writeback(struct cache_shard *sh)
+{
+    if (sh->ndirty == 0)
+    {
+        return 0;
+    }
+    struct block_iov *iov = malloc(sizeof(struct block_iov) * sh->ndirty);
+    if (iov == NULL)
+    {
+        return -ENOMEM;
+    }
+    int n = 0;
+    for (int idx = 0; idx < sh->nslots; idx++)
+    {
+        if (sh->slots[idx].dirty)
+        {
+            iov[n].lba = sh->slots[idx].lba;
+            iov[n].buf = slot_data(sh, idx);
+            n++;
+        }
+    }
+    qsort(iov, n, sizeof(struct block_iov), iov_cmp);
+
+    int status;
+    if ((status = block_writev(iov, n)) == 0)
+    {
+        for (int idx = 0; idx < sh->nslots; idx++)
+        {
+            sh->slots[idx].dirty = 0;
+        }
+        sh->writebacks += n;
+        sh->ndirty = 0;
+    }
+    free(iov);
+    return status;
+}
+
+/* copy the first 'len' bytes of a cached block out. Returns 1 on hit,
+ * 0 on miss
+ */
+static int cache_get(int lba, void *buf, size_t len, uint64_t *wgen)
+{
+    struct cache_shard *sh = shard_of(lba);
+    pthread_mutex_lock(&sh->lock);
+    int idx = shard_lookup(sh, lba);
+    if (idx >= 0)
+    {
+        memcpy(buf, slot_data(sh, idx), len);
+        sh->slots[idx].ref = 1;
+        sh->hits++;
+        if (sh->slots[idx].ra)
+        {
+            sh->slots[idx].ra = 0;
+            sh->ra_hits++;
+        }
+    }
+    else
+    {
+        sh->misses++;
+        *wgen = sh->wgen;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return idx >= 0;
+}
+
+/* install a block just read from disk, unless the shard has seen a write
+ * since the read was started (our copy could then be stale). 'ra' marks
+ * blocks brought in by cache_prefetch.
+ */
+static void cache_fill(int lba, const void *buf, uint64_t wgen, int ra)
+{
+    struct cache_shard *sh = shard_of(lba);
+    pthread_mutex_lock(&sh->lock);
+    if (sh->wgen == wgen && sh->ndirty < sh->nslots && shard_lookup(sh, lba) < 0)
+    {
+        int idx = shard_claim(sh, lba);
+        memcpy(slot_data(sh, idx), buf, fs_block_size);
+        if (ra)
+        {
+            // not referenced until someone actually reads it
+            sh->slots[idx].ref = 0;
+            sh->slots[idx].ra = 1;
+            sh->prefetched++;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* update the cached copy of a block - one that has just been written to
+ * disk, or with 'dirty' set, one that is to be written back later
+ */
+static int cache_put(int lba, const void *buf, int dirty)
+{
+    struct cache_shard *sh = shard_of(lba);
+    int status = 0;
+    pthread_mutex_lock(&sh->lock);
+    int idx = shard_lookup(sh, lba);
+    if (idx < 0)
+    {
+        // only if earlier write-backs failed
+        if (sh->ndirty >= sh->nslots && (status = shard_writeback(sh)) < 0)
+        {
+            pthread_mutex_unlock(&sh->lock);
+            return status;
+        }
+        idx = shard_claim(sh, lba);
+    }
+    memcpy(slot_data(sh, idx), buf, fs_block_size);
+    sh->slots[idx].ref = 1;
+    sh->slots[idx].ra = 0;
+    if (dirty && !sh->slots[idx].dirty)
+    {
+        sh->slots[idx].dirty = 1;
+        sh->ndirty++;
+    }
+    sh->wgen++;
+    if (sh->ndirty > sh->nslots / 2)
+    {
+        status = shard_writeback(sh);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return status;
+}
+
+/* read blocks through the cache. Cached blocks are copied out; the rest
+ * are fetched from disk with one vectored read and then cached - unless
+ * 'bulk' is set and they amount to more than an eighth of the cache, see
+ * cache_readv_bulk.
+ */
+static int cache_readv_fill(struct block_iov *iov, int n, int bulk)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+    if (!enabled)
+    {
+        return block_readv(iov, n);
+    }
+
+    struct block_iov miss[n];
+    uint64_t wgen[n];
+    int nmiss = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!cache_get(iov[i].lba, iov[i].buf, fs_block_size, &wgen[nmiss]))
+        {
+            miss[nmiss++] = iov[i];
+        }
+    }
+    if (nmiss == 0)
+    {
+        return 0;
+    }
+
+    int status;
+    if ((status = block_readv(miss, nmiss)) < 0)
+    {
+        return status;
+    }
+    if (bulk && nmiss > shards[0].nslots * CACHE_SHARDS / 8)
+    {
+        for (int i = 0; i < nmiss; i++)
+        {
+            struct cache_shard *sh = shard_of(miss[i].lba);
+            pthread_mutex_lock(&sh->lock);
+            sh->bypassed++;
+            pthread_mutex_unlock(&sh->lock);
+        }
+        return 0;
+    }
+    for (int i = 0; i < nmiss; i++)
+    {
+        cache_fill(miss[i].lba, miss[i].buf, wgen[i], 0);
+    }
+    return 0;
+}
+
+int cache_readv(struct block_iov *iov, int n)
+{
+    return cache_readv_fill(iov, n, 0);
+}
+
+/* cache_readv for file data. Caching the misses of a large read would
+ * push out blocks more likely to be wanted again than its own, so they
+ * go from disk to the caller only; a sequential reader still finds the
+ * blocks that follow in the cache, brought in by read-ahead.
+ */
+int cache_readv_bulk(struct block_iov *iov, int n)
+{
+    return cache_readv_fill(iov, n, 1);
+}
+
+/* start bringing blocks into the cache ahead of use. Blocks already
+ * cached are skipped; the rest are read with one vectored request.
+ * Nothing is copied out, and a failed read is not an error - the
+ * blocks will simply be fetched again on demand. Returns the number of
+ * blocks read.
+ */
+int cache_prefetch(const uint32_t *lba, int n)
+{
+    if (!enabled || n <= 0)
+    {
+        return 0;
+    }
+
+    struct block_iov miss[n];
+    uint64_t wgen[n];
+    int nmiss = 0;
+    for (int i = 0; i < n; i++)
+    {
+        struct cache_shard *sh = shard_of(lba[i]);
+        pthread_mutex_lock(&sh->lock);
+        if (shard_lookup(sh, lba[i]) < 0)
+        {
+            wgen[nmiss] = sh->wgen;
+            miss[nmiss++].lba = lba[i];
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    if (nmiss == 0)
+    {
+        return 0;
+    }
+
+    char *data = malloc((size_t)nmiss << fs_block_shift);
+    if (data == NULL)
+    {
+        return 0;
+    }
+    for (int i = 0; i < nmiss; i++)
+    {
+        miss[i].buf = data + ((size_t)i << fs_block_shift);
+    }
+    if (block_readv(miss, nmiss) == 0)
+    {
+        for (int i = 0; i < nmiss; i++)
+        {
+            cache_fill(miss[i].lba, miss[i].buf, wgen[i], 1);
+        }
+    }
+    free(data);
+    return nmiss;
+}
+
+int cache_writev(struct block_iov *iov, int n)
+{
+    int status;
+    if (enabled && writeback)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if ((status = cache_put(iov[i].lba, iov[i].buf, 1)) < 0)
+            {
+                return status;
+            }
+        }
+        return 0;
+    }
+
+    if ((status = block_writev(iov, n)) < 0 || !enabled)
+    {
+        return status;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        cache_put(iov[i].lba, iov[i].buf, 0);
+    }
+    return 0;
+}
+
+/* contiguous transfers are expressed as vectors so there is a single
+ * code path for hits, misses and write-through
+ */
+static int cache_rw(void *buf, int lba, int nblks, int write)
+{
+    if (!enabled)
+    {
+        return write ? block_write(buf, lba, nblks) : block_read(buf, lba, nblks);
+    }
+
+    struct block_iov iov[nblks];
+    for (int i = 0; i < nblks; i++)
+    {
+        iov[i].lba = lba + i;
+        iov[i].buf = (char *)buf + ((size_t)i << fs_block_shift);
+    }
+    return write ? cache_writev(iov, nblks) : cache_readv(iov, nblks);
+}
+
+int cache_read(void *buf, int lba, int nblks)
+{
+    return cache_rw(buf, lba, nblks, 0);
+}
+
+int cache_write(void *buf, int lba, int nblks)
+{
+    return cache_rw(buf, lba, nblks, 1);
+}
+
+/* asynchronous transfers go straight to the block layer; cached copies
+ * of written blocks are brought up to date when the write is retired.
+ * (asynchronous reads are not cached) In write-back mode a write only
+ * dirties the cache, so it is complete as soon as it is submitted.
+ */
+int cache_submit(struct block_req *req)
+{
+    if (enabled && writeback && req->write)
+    {
+        req->pending = 0;
+        req->priv = NULL;
+        return req->status = cache_writev(req->iov, req->n);
+    }
+    return block_submit(req);
+}
+
+int cache_complete(struct block_req *req)
+{
+    if (enabled && writeback && req->write)
+    {
+        return req->status;
+    }
+
+    int status;
+    if ((status = block_complete(req)) < 0 || !enabled || !req->write)
+    {
+        return status;
+    }
+    for (int i = 0; i < req->n; i++)
+    {
+        cache_put(req->iov[i].lba, req->iov[i].buf, 0);
+    }
+    return 0;
+}
+
+/* write every dirty block back to disk. (this does not fsync the image;
+ * see block_sync) Returns -EIO if error, 0 otherwise
+ */
+int cache_sync(void)
+{
+    int status = 0;
+    if (!enabled)
+    {
+        return 0;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *sh = &shards[i];
+        pthread_mutex_lock(&sh->lock);
+        int val = shard_writeback(sh);
+        pthread_mutex_unlock(&sh->lock);
+        status = (status < 0) ? status : val;
+    }
+    return status;
+}
+
+/* background write-back: every CACHE_FLUSH_INTERVAL seconds until
+ * cache_shutdown() clears 'running'
+ */
+static void *flusher_main(void *arg)
+{
+    pthread_mutex_lock(&flusher.lock);
+    while (flusher.running)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CACHE_FLUSH_INTERVAL;
+        pthread_cond_timedwait(&flusher.cond, &flusher.lock, &ts);
+        pthread_mutex_unlock(&flusher.lock);
+        cache_sync();
+        pthread_mutex_lock(&flusher.lock);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+/* stop the flusher thread and write back everything that is dirty
+ */
+int cache_shutdown(void)
+{
+    pthread_mutex_lock(&flusher.lock);
+    int running = flusher.running;
+    flusher.running = 0;
+    pthread_cond_signal(&flusher.cond);
+    pthread_mutex_unlock(&flusher.lock);
+    if (running)
+    {
+        pthread_join(flusher.thread, NULL);
+    }
+    return cache_sync();
+}
+
+/* read-only access to one block; see block_peek. Cache slots can be
+ * recycled at any time, so the block is always copied into 'scratch'.
+ */
+const void *cache_peek(void *scratch, int lba)
+{
+    if (!enabled)
+    {
+        return block_peek(scratch, lba);
+    }
+    return (cache_read(scratch, lba, 1) < 0) ? NULL : scratch;
+}
+
+/* Metadata - inodes, directory and index blocks, bitmaps - keeps its
+ * FS_BLOCK_SIZE layout at the start of its block whatever the block
+ * size. These transfer just that part; on write the rest of the block is
+ * zeroed. With 4 KB blocks they are ordinary single-block transfers.
+ */
+int cache_read_meta(void *buf, int lba)
+{
+    if (fs_block_size == FS_BLOCK_SIZE)
+    {
+        return cache_read(buf, lba, 1);
+    }
+
+    uint64_t wgen = 0;
+    if (enabled && cache_get(lba, buf, FS_BLOCK_SIZE, &wgen))
+    {
+        return 0;
+    }
+    char *blk = malloc(fs_block_size);
+    if (blk == NULL)
+    {
+        return -ENOMEM;
+    }
+    int status;
+    if ((status = block_read(blk, lba, 1)) == 0)
+    {
+        memcpy(buf, blk, FS_BLOCK_SIZE);
+        if (enabled)
+        {
+            cache_fill(lba, blk, wgen, 0);
+        }
+    }
+    free(blk);
+    return status;
+}
+
+int cache_write_meta(void *buf, int lba)
+{
+    if (fs_block_size == FS_BLOCK_SIZE)
+    {
+        return cache_write(buf, lba, 1);
+    }
+
+    char *blk = calloc(1, fs_block_size);
+    if (blk == NULL)
+    {
+        return -ENOMEM;
+    }
+    memcpy(blk, buf, FS_BLOCK_SIZE);
+    int status = cache_write(blk, lba, 1);
+    free(blk);
+    return status;
+}
+
+/* vectored cache_read_meta, 'buf' pointing at FS_BLOCK_SIZE bytes each
+ */
+int cache_readv_meta(struct block_iov *iov, int n)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+    if (fs_block_size == FS_BLOCK_SIZE)
+    {
+        return cache_readv(iov, n);
+    }
+
+    char *data = malloc((size_t)n << fs_block_shift);
+    if (data == NULL)
+    {
+        return -ENOMEM;
+    }
+    struct block_iov blk[n];
+    for (int i = 0; i < n; i++)
+    {
+        blk[i].lba = iov[i].lba;
+        blk[i].buf = data + ((size_t)i << fs_block_shift);
+    }
+    int status;
+    if ((status = cache_readv(blk, n)) == 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(iov[i].buf, blk[i].buf, FS_BLOCK_SIZE);
+        }
+    }
+    free(data);
+    return status;
+}
+
+/* cache_peek for metadata; 'scratch' need only be FS_BLOCK_SIZE bytes
+ */
+const void *cache_peek_meta(void *scratch, int lba)
+{
+    if (fs_block_size == FS_BLOCK_SIZE || (!enabled && block_mapped()))
+    {
+        return cache_peek(scratch, lba);
+    }
+    return (cache_read_meta(scratch, lba) < 0) ? NULL : scratch;
+}
+
+/* set the memory budget (bytes of block data) used by cache_init; 0
+ * disables caching
+ */
+void cache_budget(size_t bytes)
+{
+    budget = bytes;
+}
+
+/* select write-back (1) or write-through (0) mode; call before cache_init
+ */
+void cache_writeback(int on)
+{
+    writeback = on;
+}
+
+/* nonzero if writes are currently being held in the cache
+ */
+int cache_writing_back(void)
+{
+    return enabled && writeback;
+}
+
+int cache_init(void)
+{
+    int nslots = (budget >> fs_block_shift) / CACHE_SHARDS;
+
+    /* a mapped image is already entirely in memory */
+    if (enabled || nslots == 0 || block_mapped())
+    {
+        return 0;
+    }
+
+    int nbuckets = 1;
+    while (nbuckets < nslots)
+    {
+        nbuckets <<= 1;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *sh = &shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->nslots = nslots;
+        sh->bucket_mask = nbuckets - 1;
+        sh->buckets = malloc(sizeof(int) * nbuckets);
+        sh->slots = malloc(sizeof(struct cache_slot) * nslots);
+        sh->data = malloc((size_t)nslots << fs_block_shift);
+        if (sh->buckets == NULL || sh->slots == NULL || sh->data == NULL)
+        {
+            return -ENOMEM;
+        }
+        memset(sh->buckets, 0xff, sizeof(int) * nbuckets);
+        for (int idx = 0; idx < nslots; idx++)
+        {
+            sh->slots[idx].lba = -1;
+            sh->slots[idx].ref = 0;
+            sh->slots[idx].dirty = 0;
+            sh->slots[idx].ra = 0;
+            sh->slots[idx].next = -1;
+        }
+    }
+    enabled = 1;
+
+    if (writeback)
+    {
+        flusher.running = 1;
+        if (pthread_create(&flusher.thread, NULL, flusher_main, NULL) != 0)
+        {
+            flusher.running = 0;
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void cache_get_stats(struct cache_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!enabled)
+    {
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *sh = &shards[i];
+        pthread_mutex_lock(&sh->lock);
+        st->hits += sh->hits;
+        st->misses += sh->misses;
+        st->evictions += sh->evictions;
+        st->writebacks += sh->writebacks;
+        st->dirty += sh->ndirty;
+        st->prefetched += sh->prefetched;
+        st->ra_hits += sh->ra_hits;
+        st->bypassed += sh->bypassed;
+        pthread_mutex_unlock(&sh->lock);
+    }
+    st->budget = ((size_t)shards[0].nslots * CACHE_SHARDS) << fs_block_shift;
+}
@@ -0,0 +1,54 @@
+/*
+ * file:        cache.h
+ * description: block buffer cache sitting between homework.c and misc.c
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "misc.h"
+
+#define CACHE_DEFAULT_BUDGET (8 << 20)  /* bytes of block data */
+
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;        /* dirty blocks written to disk */
+    uint64_t dirty;             /* currently dirty blocks */
+    uint64_t prefetched;        /* blocks brought in by cache_prefetch */
+    uint64_t ra_hits;           /* ... that were later read */
+    uint64_t bypassed;          /* misses of large reads, not cached */
+    size_t   budget;            /* bytes, 0 if the cache is disabled */
+};
+
+/* same conventions as the block_* functions in misc.h
+ */
+int cache_read(void *buf, int lba, int nblks);
+int cache_write(void *buf, int lba, int nblks);
+int cache_readv(struct block_iov *iov, int n);
+int cache_readv_bulk(struct block_iov *iov, int n);
+int cache_writev(struct block_iov *iov, int n);
+int cache_submit(struct block_req *req);
+int cache_complete(struct block_req *req);
+const void *cache_peek(void *scratch, int lba);
+int cache_prefetch(const uint32_t *lba, int n);
+int cache_sync(void);
+
+/* metadata blocks: only the first FS_BLOCK_SIZE bytes, see cache.c
+ */
+int cache_read_meta(void *buf, int lba);
+int cache_write_meta(void *buf, int lba);
+int cache_readv_meta(struct block_iov *iov, int n);
+const void *cache_peek_meta(void *scratch, int lba);
+
+void cache_budget(size_t bytes);
+void cache_writeback(int on);
+int cache_writing_back(void);
+int cache_init(void);
+int cache_shutdown(void);
+void cache_get_stats(struct cache_stats *st);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * file:        dcache.c
+ * description: directory entry cache
+ *
+ * Maps (parent directory inum, name) to the inum of the entry and
+ * whether it is a directory, so that translate() can walk a path it has
+ * seen before without reading any inode or directory block. Entries are
+ * added by translate() when it has to scan a directory, and kept exact by
+ * the operations that change the namespace (create, mkdir, unlink,
+ * rmdir, rename). The table has a fixed number of entries and replaces
+ * them with the CLOCK algorithm.
+ *
+ * A negative entry (inum 0) records that a name is absent, so a repeated
+ * probe for a missing file fails without scanning the directory again.
+ * Adding the name replaces the negative entry like any other. Negative
+ * entries are capped at DCACHE_NEGATIVE_MAX so that a flood of failed
+ * lookups cannot push out the positive ones.
+ *
+ * translate() scans a directory without holding any lock, so what it
+ * found may be out of date by the time it adds it: a create or unlink
+ * can commit and update the cache in between. Every change to a
+ * directory's entries bumps that directory's generation (kept in a
+ * small table hashed by inum, so unrelated directories may share one),
+ * and dcache_fill drops a result whose generation moved during the scan.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dcache.h"
+
+#define DCACHE_NAME_LEN 27
+#define DCACHE_GEN_SLOTS 256
+
+struct dentry {
+    int      parent;            /* 0 if empty */
+    int      inum;              /* 0 if the name is known to be absent */
+    int      next;              /* hash chain, -1 terminates */
+    uint8_t  isdir;
+    uint8_t  ref;               /* CLOCK reference bit */
+    uint8_t  len;
+    char     name[DCACHE_NAME_LEN];
+};
+
+static struct dentry dentries[DCACHE_ENTRIES];
+static int buckets[DCACHE_ENTRIES];     /* heads of hash chains */
+static uint32_t dir_gen[DCACHE_GEN_SLOTS];      /* see dcache_dir_gen */
+static int hand;
+static int initialized;
+static struct dcache_stats stats;
+static pthread_mutex_t dc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a over the parent inum and the name
+ */
+static uint32_t dentry_hash(int parent, const char *name, int len)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)parent;
+    h *= 16777619u;
+    for (int i = 0; i < len; i++)
+    {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int *bucket_of(int parent, const char *name, int len)
+{
+    return &buckets[dentry_hash(parent, name, len) % DCACHE_ENTRIES];
+}
+
+/* caller holds dc_lock
+ */
+static void dcache_setup(void)
+{
+    if (initialized)
+    {
+        return;
+    }
+    memset(buckets, 0xff, sizeof(buckets));
+    for (int i = 0; i < DCACHE_ENTRIES; i++)
+    {
+        dentries[i].next = -1;
+    }
+    initialized = 1;
+}
+
+/* pointer to the chain link referring to the entry for (parent, name),
+ * or to the terminating -1. Caller holds dc_lock
+ */
+static int *dentry_find(int parent, const char *name, int len)
+{
+    int *pidx = bucket_of(parent, name, len);
+    while (*pidx >= 0)
+    {
+        struct dentry *de = &dentries[*pidx];
+        if (de->parent == parent && de->len == len && memcmp(de->name, name, len) == 0)
+        {
+            break;
+        }
+        pidx = &de->next;
+    }
+    return pidx;
+}
+
+static void dentry_unlink(int *pidx)
+{
+    struct dentry *de = &dentries[*pidx];
+    *pidx = de->next;
+    if (de->inum == 0)
+    {
+        stats.negative--;
+    }
+    de->parent = 0;
+    de->next = -1;
+    stats.entries--;
+}
+
+/* returns the inum of the 'len' byte 'name' in directory 'parent' and
+ * sets '*isdir', -ENOENT if the name is known to be absent, or 0 if it
+ * is not cached. Names are at most DCACHE_NAME_LEN bytes and need not
+ * be NUL-terminated.
+ */
+int dcache_lookup(int parent, const char *name, int len, int *isdir)
+{
+    int inum = 0;
+    pthread_mutex_lock(&dc_lock);
+    dcache_setup();
+    int idx = *dentry_find(parent, name, len);
+    if (idx >= 0)
+    {
+        dentries[idx].ref = 1;
+        if (dentries[idx].inum == 0)
+        {
+            inum = -ENOENT;
+            stats.neg_hits++;
+        }
+        else
+        {
+            *isdir = dentries[idx].isdir;
+            inum = dentries[idx].inum;
+            stats.hits++;
+        }
+    }
+    else
+    {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&dc_lock);
+    return inum;
+}
+
+/* find a free entry, evicting with CLOCK if necessary. Once the negative
+ * entries reach their cap, a new negative entry can only replace another
+ * negative one. Caller holds dc_lock
+ */
+static int dentry_claim(int negative)
+{
+    int only_negative = negative && stats.negative >= DCACHE_NEGATIVE_MAX;
+    for (;;)
+    {
+        int idx = hand;
+        hand = (hand + 1) % DCACHE_ENTRIES;
+        struct dentry *de = &dentries[idx];
+        if (de->parent == 0 && !only_negative)
+        {
+            return idx;
+        }
+        if (de->parent == 0 || (only_negative && de->inum != 0))
+        {
+            continue;
+        }
+        if (!de->ref)
+        {
+            dentry_unlink(dentry_find(de->parent, de->name, de->len));
+            stats.evictions++;
+            return idx;
+        }
+        de->ref = 0;
+    }
+}
+
+/* the generation of directory 'parent', to be passed to dcache_fill
+ * after scanning it
+ */
+uint32_t dcache_dir_gen(int parent)
+{
+    return __atomic_load_n(&dir_gen[parent % DCACHE_GEN_SLOTS], __ATOMIC_ACQUIRE);
+}
+
+/* caller holds dc_lock
+ */
+static void dentry_set(int parent, const char *name, int len, int inum, int isdir)
+{
+    int *pidx = dentry_find(parent, name, len);
+    if (*pidx >= 0)
+    {
+        dentry_unlink(pidx);
+    }
+
+    int idx = dentry_claim(inum == 0);
+
+    struct dentry *de = &dentries[idx];
+    int *head = bucket_of(parent, name, len);
+    de->parent = parent;
+    de->inum = inum;
+    de->isdir = isdir ? 1 : 0;
+    de->ref = 1;
+    de->len = len;
+    memcpy(de->name, name, len);
+    de->next = *head;
+    *head = idx;
+    stats.entries++;
+    if (inum == 0)
+    {
+        stats.negative++;
+    }
+}
+
+/* record that 'name' in directory 'parent' is now 'inum', or with 'inum'
+ * 0 that it does not exist, replacing any previous entry for the name.
+ * For operations that change the directory.
+ */
+void dcache_insert(int parent, const char *name, int len, int inum, int isdir)
+{
+    pthread_mutex_lock(&dc_lock);
+    dcache_setup();
+    __atomic_add_fetch(&dir_gen[parent % DCACHE_GEN_SLOTS], 1, __ATOMIC_RELEASE);
+    dentry_set(parent, name, len, inum, isdir);
+    pthread_mutex_unlock(&dc_lock);
+}
+
+/* as dcache_insert, for what a scan of 'parent' found; ignored if the
+ * directory has changed since dcache_dir_gen returned 'gen'
+ */
+void dcache_fill(int parent, const char *name, int len, int inum, int isdir, uint32_t gen)
+{
+    pthread_mutex_lock(&dc_lock);
+    dcache_setup();
+    if (dir_gen[parent % DCACHE_GEN_SLOTS] == gen)
+    {
+        dentry_set(parent, name, len, inum, isdir);
+    }
+    pthread_mutex_unlock(&dc_lock);
+}
+
+/* forget 'name' in directory 'parent', if it is cached
+ */
+void dcache_remove(int parent, const char *name, int len)
+{
+    pthread_mutex_lock(&dc_lock);
+    dcache_setup();
+    __atomic_add_fetch(&dir_gen[parent % DCACHE_GEN_SLOTS], 1, __ATOMIC_RELEASE);
+    int *pidx = dentry_find(parent, name, len);
+    if (*pidx >= 0)
+    {
+        dentry_unlink(pidx);
+    }
+    pthread_mutex_unlock(&dc_lock);
+}
+
+/* forget every entry in directory 'parent'. Called when the directory is
+ * removed, since its inode number may be reused for a new, empty one.
+ */
+void dcache_forget_dir(int parent)
+{
+    pthread_mutex_lock(&dc_lock);
+    dcache_setup();
+    __atomic_add_fetch(&dir_gen[parent % DCACHE_GEN_SLOTS], 1, __ATOMIC_RELEASE);
+    for (int idx = 0; idx < DCACHE_ENTRIES; idx++)
+    {
+        if (dentries[idx].parent == parent)
+        {
+            dentry_unlink(dentry_find(parent, dentries[idx].name, dentries[idx].len));
+        }
+    }
+    pthread_mutex_unlock(&dc_lock);
+}
+
+void dcache_get_stats(struct dcache_stats *st)
+{
+    pthread_mutex_lock(&dc_lock);
+    memcpy(st, &stats, sizeof(*st));
+    pthread_mutex_unlock(&dc_lock);
+}
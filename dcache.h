@@ -0,0 +1,30 @@
+/*
+ * file:        dcache.h
+ * description: directory entry cache used by path translation
+ */
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include <stdint.h>
+
+#define DCACHE_ENTRIES 4096
+#define DCACHE_NEGATIVE_MAX 1024        /* at most this many absent names */
+
+struct dcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t neg_hits;          /* directory scans saved by negative entries */
+    uint64_t evictions;
+    int      entries;           /* currently cached names */
+    int      negative;          /* ... of which are known absent */
+};
+
+int dcache_lookup(int parent, const char *name, int len, int *isdir);
+void dcache_insert(int parent, const char *name, int len, int inum, int isdir);
+uint32_t dcache_dir_gen(int parent);
+void dcache_fill(int parent, const char *name, int len, int inum, int isdir, uint32_t gen);
+void dcache_remove(int parent, const char *name, int len);
+void dcache_forget_dir(int parent);
+void dcache_get_stats(struct dcache_stats *st);
+
+#endif
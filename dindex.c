@@ -0,0 +1,249 @@
+/*
+ * file:        dindex.c
+ * description: per-directory name index
+ *
+ * Directory entries live in blocks of 128, and looking a name up in a
+ * block used to mean strcmp against every one of them. This keeps, for
+ * recently used entry blocks, an open-addressed hash table from name to
+ * entry slot plus a bitmap of the valid slots, so a lookup is one or two
+ * probes and finding a free slot is a count-trailing-zeros.
+ *
+ * The index is per entry block, keyed by its block number, not per
+ * directory. A linear directory consults it for each of its blocks in
+ * turn; an indexed directory first picks the one leaf block a name can
+ * be in from its on-disk hash index (see dir_search in homework.c) and
+ * consults this only for that leaf.
+ *
+ * The index never holds names. The caller passes in the entry block it
+ * has already read, and every candidate slot is checked against it, so
+ * a stale index can cost time but never return a wrong entry. It is kept
+ * current anyway: it is rebuilt whenever the block is written through
+ * lookup_commit(), and dropped when the block leaves its directory.
+ *
+ * A block is indexed the second time it is looked at. A one-off
+ * lookup is cheaper as a straight scan, which compares a whole 32-byte
+ * entry (valid bit and name) per vector instruction.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "dindex.h"
+
+#define DIR_ENTRIES (int)(FS_BLOCK_SIZE / sizeof(struct fs_dirent))
+#define DINDEX_BUCKETS 256      /* power of 2, at least 2 * DIR_ENTRIES */
+
+_Static_assert(sizeof(struct fs_dirent) == 32, "scan assumes 32-byte dirents");
+
+struct dir_index {
+    int      lba;               /* entry block, 0 if unused */
+    uint8_t  built;             /* 0 until the second lookup */
+    uint64_t used[DIR_ENTRIES / 64];    /* valid slots */
+    uint8_t  bucket[DINDEX_BUCKETS];    /* slot + 1, 0 if empty */
+};
+
+static struct dir_index dirs[DINDEX_DIRS];
+static struct dindex_stats stats;
+static pthread_mutex_t di_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a
+ */
+static uint32_t name_hash(const char *name, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++)
+    {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* index of the valid entry called 'name', or -1, by brute force. Each
+ * entry is compared with a 32-byte key holding the valid bit and the
+ * name followed by its NUL; the mask ignores the inode number and any
+ * bytes after the NUL, which gives exactly strcmp's answer.
+ */
+static int scan_entries(const struct fs_dirent *entries, const char *name, int len)
+{
+    uint8_t key[32] = {0}, mask[32] = {0};
+    key[0] = mask[0] = 1;       /* 'valid' is the low bit of the first word */
+    memcpy(key + 4, name, len);
+    memset(mask + 4, 0xff, len + 1);
+
+#if defined(__AVX2__)
+    __m256i k = _mm256_loadu_si256((const __m256i *)key);
+    __m256i m = _mm256_loadu_si256((const __m256i *)mask);
+    for (int i = 0; i < DIR_ENTRIES; i++)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&entries[i]);
+        __m256i x = _mm256_and_si256(_mm256_xor_si256(d, k), m);
+        if (_mm256_testz_si256(x, x))
+        {
+            return i;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i klo = _mm_loadu_si128((const __m128i *)key);
+    __m128i khi = _mm_loadu_si128((const __m128i *)(key + 16));
+    __m128i mlo = _mm_loadu_si128((const __m128i *)mask);
+    __m128i mhi = _mm_loadu_si128((const __m128i *)(mask + 16));
+    __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < DIR_ENTRIES; i++)
+    {
+        const __m128i *d = (const __m128i *)&entries[i];
+        __m128i x = _mm_or_si128(_mm_and_si128(_mm_xor_si128(_mm_loadu_si128(d), klo), mlo),
+                                 _mm_and_si128(_mm_xor_si128(_mm_loadu_si128(d + 1), khi), mhi));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) == 0xffff)
+        {
+            return i;
+        }
+    }
+#else
+    for (int i = 0; i < DIR_ENTRIES; i++)
+    {
+        const uint8_t *d = (const uint8_t *)&entries[i];
+        int j;
+        for (j = 0; j < 32 && ((d[j] ^ key[j]) & mask[j]) == 0; j++)
+            ;
+        if (j == 32)
+        {
+            return i;
+        }
+    }
+#endif
+    return -1;
+}
+
+static int first_free(const struct fs_dirent *entries)
+{
+    for (int i = 0; i < DIR_ENTRIES; i++)
+    {
+        if (!entries[i].valid)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* caller holds di_lock
+ */
+static void index_build(struct dir_index *d, const struct fs_dirent *entries)
+{
+    memset(d->used, 0, sizeof(d->used));
+    memset(d->bucket, 0, sizeof(d->bucket));
+    for (int i = 0; i < DIR_ENTRIES; i++)
+    {
+        if (!entries[i].valid)
+        {
+            continue;
+        }
+        d->used[i / 64] |= 1ULL << (i % 64);
+        uint32_t b = name_hash(entries[i].name, strnlen(entries[i].name, sizeof(entries[i].name)));
+        while (d->bucket[b & (DINDEX_BUCKETS - 1)] != 0)
+        {
+            b++;
+        }
+        d->bucket[b & (DINDEX_BUCKETS - 1)] = i + 1;
+    }
+    d->built = 1;
+    stats.builds++;
+}
+
+/* find 'name' ('len' bytes, not NUL-terminated) in the entry block at
+ * 'lba', whose contents are 'entries'. Returns its slot or -1, and if
+ * 'freeSlot' is not NULL sets it to the first unused slot (or -1).
+ */
+int dindex_lookup(int lba, const struct fs_dirent *entries, const char *name,
+                  int len, int *freeSlot)
+{
+    struct dir_index *d = &dirs[(unsigned)lba % DINDEX_DIRS];
+    int slot = -1;
+
+    pthread_mutex_lock(&di_lock);
+    if (d->lba != lba)
+    {
+        d->lba = lba;
+        d->built = 0;
+    }
+    else if (!d->built)
+    {
+        index_build(d, entries);
+    }
+
+    if (!d->built)
+    {
+        stats.scanned++;
+        pthread_mutex_unlock(&di_lock);
+        if (freeSlot != NULL)
+        {
+            *freeSlot = first_free(entries);
+        }
+        return (len > 0) ? scan_entries(entries, name, len) : -1;
+    }
+
+    stats.indexed++;
+    if (len > 0)
+    {
+        for (uint32_t b = name_hash(name, len); d->bucket[b & (DINDEX_BUCKETS - 1)] != 0; b++)
+        {
+            int i = d->bucket[b & (DINDEX_BUCKETS - 1)] - 1;
+            if (entries[i].valid && entries[i].name[len] == 0 && memcmp(entries[i].name, name, len) == 0)
+            {
+                slot = i;
+                break;
+            }
+        }
+    }
+    if (freeSlot != NULL)
+    {
+        *freeSlot = -1;
+        for (int w = 0; w < DIR_ENTRIES / 64; w++)
+        {
+            if (~d->used[w] != 0)
+            {
+                *freeSlot = w * 64 + __builtin_ctzll(~d->used[w]);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&di_lock);
+    return slot;
+}
+
+/* the entry block at 'lba' has been rewritten as 'entries'
+ */
+void dindex_update(int lba, const struct fs_dirent *entries)
+{
+    struct dir_index *d = &dirs[(unsigned)lba % DINDEX_DIRS];
+    pthread_mutex_lock(&di_lock);
+    if (d->lba == lba && d->built)
+    {
+        index_build(d, entries);
+    }
+    pthread_mutex_unlock(&di_lock);
+}
+
+/* the block at 'lba' is no longer a directory
+ */
+void dindex_forget(int lba)
+{
+    struct dir_index *d = &dirs[(unsigned)lba % DINDEX_DIRS];
+    pthread_mutex_lock(&di_lock);
+    if (d->lba == lba)
+    {
+        d->lba = 0;
+        d->built = 0;
+    }
+    pthread_mutex_unlock(&di_lock);
+}
+
+void dindex_get_stats(struct dindex_stats *st)
+{
+    pthread_mutex_lock(&di_lock);
+    memcpy(st, &stats, sizeof(*st));
+    pthread_mutex_unlock(&di_lock);
+}
@@ -0,0 +1,26 @@
+/*
+ * file:        dindex.h
+ * description: in-memory index of directory entry blocks
+ */
+#ifndef __DINDEX_H__
+#define __DINDEX_H__
+
+#include <stdint.h>
+
+#include "fs5600.h"
+
+#define DINDEX_DIRS 256         /* directories indexed at once */
+
+struct dindex_stats {
+    uint64_t indexed;           /* lookups answered by a hash probe */
+    uint64_t scanned;           /* ... by scanning the whole block */
+    uint64_t builds;
+};
+
+int dindex_lookup(int lba, const struct fs_dirent *entries, const char *name,
+                  int len, int *freeSlot);
+void dindex_update(int lba, const struct fs_dirent *entries);
+void dindex_forget(int lba);
+void dindex_get_stats(struct dindex_stats *st);
+
+#endif
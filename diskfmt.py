@@ -1,6 +1,7 @@
 from ctypes import *
 
 MAGIC = 0x30303635
+STATE_CLEAN = 0x544e4d55
 
 class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
@@ -10,7 +11,14 @@ class dirent(Structure):
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("group_blocks", c_uint),
+                ("state", c_uint),
+                ("free_blocks", c_uint),
+                ("group_free", c_uint * 1018),
+                ("block_size", c_uint)]     # 0 = 4096
+
+def block_size(sb):
+    return sb.block_size or 4096
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -36,12 +44,44 @@ class bitmap(Structure):
             n = n & (mask ^ 0xffffffff)
         self.vals[i // 32] = n
 
+class blockmap(object):
+    '''the bitmaps of all groups, indexed by block number'''
+    def __init__(self, sb, blks):
+        self.per = sb.group_blocks or 4096 * 8
+        ngroups = (sb.disk_sz + self.per - 1) // self.per
+        self.maps = [bitmap.from_buffer_copy(blks[1 if g == 0 else g * self.per])
+                         for g in range(ngroups)]
+    def get(self, i):
+        g, bit = divmod(i, self.per)
+        return (g > 0 and bit == 0) or self.maps[g].get(bit)
+
 S_IFMT  = 0o0170000  # bit mask for the file type bit field
 S_IFREG = 0o0100000  # regular file
 S_IFDIR = 0o0040000  # directory
+FS_DIR_INDEXED = 0o0200000  # directory with an htree index in ptrs[0]
+FS_INODE_EXTENTS = 0o0400000  # file mapped by extents, see file_blocks()
 
 def S_ISREG(mode):
     return (mode & S_IFMT) == S_IFREG
 
 def S_ISDIR(mode):
     return (mode & S_IFMT) == S_IFDIR
+
+def file_size(_in):
+    if _in.mode & FS_INODE_EXTENTS:
+        return (_in.ptrs[0] << 32) | (_in.size & 0xffffffff)
+    return _in.size
+
+def file_blocks(_in, bsize=4096):
+    '''block numbers of a file, in order; 0 for a hole'''
+    n = (file_size(_in) + bsize - 1) // bsize
+    if not _in.mode & FS_INODE_EXTENTS:
+        return list(_in.ptrs[0:n])
+    blocks = []
+    for i in range(_in.ptrs[1]):
+        start, length = _in.ptrs[2 + 2*i], _in.ptrs[3 + 2*i]
+        if start == 0:
+            blocks.extend([0] * length)
+        else:
+            blocks.extend(range(start, start + length))
+    return blocks[0:n]
@@ -8,7 +8,13 @@
 #ifndef __CSX600_H__
 #define __CSX600_H__
 
+/* Blocks are FS_BLOCK_SIZE bytes unless the superblock records a larger
+ * power of two, up to FS_MAX_BLOCK_SIZE. The structures below always
+ * occupy the first FS_BLOCK_SIZE bytes of their block; only file data
+ * fills the whole block.
+ */
 #define FS_BLOCK_SIZE 4096
+#define FS_MAX_BLOCK_SIZE 65536
 #define FS_MAGIC 0x30303635
 
 /* how many buckets of size M do you need to hold N items? 
@@ -23,16 +29,36 @@ struct fs_dirent {
     char name[28];              /* with trailing NUL */
 };
 
-/* Superblock - holds file system parameters. 
+/* Superblock - holds file system parameters. The free counts are
+ * written at unmount and only valid while 'state' says it was clean;
+ * groups past FS_SUPER_GROUPS are always counted at mount.
  */
+#define FS_STATE_CLEAN 0x544e4d55   /* "UMNT" */
+#define FS_SUPER_GROUPS (FS_BLOCK_SIZE/4 - 6)
+
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
-    
-    /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    uint32_t group_blocks;      /* blocks per bitmap group; 0 = FS_BLOCK_SIZE*8 */
+    uint32_t state;             /* FS_STATE_CLEAN, or 0 while mounted */
+    uint32_t free_blocks;
+    uint32_t group_free[FS_SUPER_GROUPS];
+    uint32_t block_size;        /* bytes; 0 = FS_BLOCK_SIZE */
+};                              /* superblock = 4096 bytes */
+
+/* A run of 'len' consecutive blocks starting at 'start'
+ */
+struct fs_extent {
+    uint32_t start;
+    uint32_t len;
 };
 
+#define FS_INODE_EXTENTS_MAX ((FS_BLOCK_SIZE - 28) / 8)
+
+/* An inode either maps its blocks one pointer at a time in ptrs[], or,
+ * with FS_INODE_EXTENTS set in mode, as a list of extents in file order
+ * with 'size' holding the low half of a 64-bit file size.
+ */
 struct fs_inode {
     uint16_t uid;
     uint16_t gid;
@@ -40,7 +66,52 @@ struct fs_inode {
     uint32_t ctime;
     uint32_t mtime;
     int32_t  size;
-    uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
+    union {
+        uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
+        struct {
+            uint32_t size_hi;
+            uint32_t nextents;
+            struct fs_extent extents[FS_INODE_EXTENTS_MAX];
+        };
+    };
+};
+
+/* Mode bits above S_IFMT are file system flags and never reach stat()
+ */
+#define FS_DIR_INDEXED   0200000    /* directory: ptrs[0] is an fs_htree */
+#define FS_INODE_EXTENTS 0400000    /* file: block map is extents[] */
+#define FS_MODE_FLAGS    (FS_DIR_INDEXED | FS_INODE_EXTENTS)
+
+static inline int64_t inode_size(const struct fs_inode *inode)
+{
+    if (inode->mode & FS_INODE_EXTENTS)
+        return ((int64_t)inode->size_hi << 32) | (uint32_t)inode->size;
+    return inode->size;
+}
+
+static inline void inode_set_size(struct fs_inode *inode, int64_t size)
+{
+    inode->size = (int32_t)(uint32_t)size;
+    if (inode->mode & FS_INODE_EXTENTS)
+        inode->size_hi = (uint32_t)(size >> 32);
+}
+
+/* Index block of an indexed directory. Entry i covers name hashes from
+ * entries[i].hash up to (not including) entries[i+1].hash; entries are
+ * sorted and entries[0].hash is 0.
+ */
+#define FS_HTREE_MAGIC 0x45455248   /* "HREE" */
+#define FS_HTREE_ENTRIES (FS_BLOCK_SIZE/8 - 1)
+
+struct fs_htree_entry {
+    uint32_t hash;
+    uint32_t block;             /* leaf block holding those names */
+};
+
+struct fs_htree {
+    uint32_t magic;
+    uint32_t count;             /* entries in use */
+    struct fs_htree_entry entries[FS_HTREE_ENTRIES];
 };
 
 #endif
@@ -14,6 +14,11 @@ if sys.argv[1] == '-q':
     sys.argv.pop(1)
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
+bsize = 4096            # 'blocksize N' in the input to change
+
+# metadata fills the first 4096 bytes of a block, zeros the rest
+def pad(data):
+    return data + bytearray(bsize - len(data))
 
 class file(object):
     def __init__(self, fields):
@@ -28,14 +33,14 @@ class file(object):
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
         for j in range(len(self.blocks)):
             i.ptrs[j] = self.blocks[j]
-        return bytearray(i)
+        return pad(bytearray(i))
 
     def block(self,offset):
         if not quiet:
             print("block", self.name, offset)
         rnd.seed(hash(self.name) + offset)
         val = ''
-        for i in range(4096):
+        for i in range(bsize):
             n = rnd.randint(0,50)
             val = val + chars[n]
         return bytearray(val)
@@ -62,7 +67,7 @@ class dir(object):
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
         for j in range(len(self.blocks)):
             i.ptrs[j] = self.blocks[j]
-        return bytearray(i)
+        return pad(bytearray(i))
 
     # dirent is 32 bytes, 128 per block
     def block(self,offset):
@@ -74,7 +79,7 @@ class dir(object):
             de.valid, de.inode, de.name = val, num, name
             data[j:j+32] = bytearray(de)
             j += 32
-        return data
+        return pad(data)
         
         
 syms = dict()
@@ -96,6 +101,10 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'size':
         nblocks = int(fields[1])
         continue
+
+    if fields[0] == 'blocksize':
+        bsize = int(fields[1])
+        continue
     
     for i in range(len(fields)):
         if fields[i][0] == '$':
@@ -105,33 +114,46 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'dir':
         dirs.append(dir(fields[1:]))
 
-blockmap = fs.bitmap()
-blockmap.set(0,True)                      # superblock
-blockmap.set(1,True)                      # bitmap
+# one bitmap block per group of 32K blocks: block 1 for group 0, the
+# group's first block (marked in its own bitmap) for the others
+group = 4096 * 8
+bitmaps = [fs.bitmap() for g in range((nblocks + group - 1) // group)]
+bitmaps[0].set(0,True)                    # superblock
+bitmaps[0].set(1,True)                    # bitmap
+for g in range(1, len(bitmaps)):
+    bitmaps[g].set(0,True)
+
+def mark(b):
+    if bitmaps[b // group].get(b % group):
+        print 'ERROR: double counted', b
+    bitmaps[b // group].set(b % group, True)
 
-blocks = [None] * 400
+blocks = [None] * nblocks
 
 for f in files + dirs:
     blocks[f.inum] = [f]
-    blockmap.set(f.inum, True)
+    mark(f.inum)
     i = 0
     for b in f.blocks:
-        if blockmap.get(b):
-            print 'ERROR: double counted', b
-        blockmap.set(b, True)
+        mark(b)
         blocks[b] = [f,i]
         i += 1
 
 sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
-zeros = bytearray(4096)
+if bsize != 4096:
+    sb.block_size = bsize
 
+# unused blocks are left as holes in the image file, so that large
+# images take little space
 fp = open(sys.argv[2], 'wb')
-fp.write(bytearray(sb))
-fp.write(bytearray(blockmap))
+fp.write(pad(bytearray(sb)))
+fp.write(pad(bytearray(bitmaps[0])))
 for i in range(2,nblocks):
-    if not blocks[i]:
-        fp.write(zeros)
+    if i % group == 0:
+        fp.write(pad(bytearray(bitmaps[i // group])))
+    elif not blocks[i]:
+        fp.seek(bsize, 1)
     elif len(blocks[i]) == 1:
         inode = blocks[i][0]
         fp.write(inode.inode())
@@ -140,6 +162,7 @@ for i in range(2,nblocks):
         if not quiet:
             print('item', item.name)
         fp.write(item.block(offset))
+fp.truncate(nblocks * bsize)
 fp.close()
 
 
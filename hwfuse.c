@@ -8,11 +8,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #include <fuse.h>
 
 #include "fs5600.h"
-
-extern void block_init(char *file);
+#include "cache.h"
+#include "readahead.h"
+#include "dcache.h"
+#include "icache.h"
+#include "dindex.h"
+#include "balloc.h"
 
 /* All homework functions are accessed through the operations
  * structure.  
@@ -21,6 +26,10 @@ extern struct fuse_operations fs_ops;
 
 struct data {
     char *image_name;
+    char *backend;
+    char *cache_mb;
+    char *ra_blocks;
+    int   writeback;
     int   part;
     int   cmd_mode;
 } _data;
@@ -31,12 +40,27 @@ struct data {
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
- *              disk.img  - name of the image file to mount
- *              directory - directory to mount it on
+ *  usage: ./homework -image disk.img [-backend name] [-cache MB]
+ *                    [-readahead N] [-writeback] directory
+ *              disk.img   - name of the image file to mount
+ *              name       - block I/O backend: pread (default), mmap
+ *                           or uring. A mapped image is used in place
+ *                           of the block cache, so mmap cannot be
+ *                           combined with -writeback, and -cache is
+ *                           ignored; close starts an msync instead
+ *              MB         - block cache size in MB (default 8, 0 = off)
+ *              N          - largest read-ahead window in blocks
+ *                           (default 64, 0 = off)
+ *              -writeback - cache writes, flushing them periodically
+ *                           and on fsync/close/unmount
+ *              directory  - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-backend %s", offsetof(struct data, backend), 0},
+    {"-cache %s", offsetof(struct data, cache_mb), 0},
+    {"-readahead %s", offsetof(struct data, ra_blocks), 0},
+    {"-writeback", offsetof(struct data, writeback), 1},
     FUSE_OPT_END
 };
 
@@ -48,7 +72,63 @@ int main(int argc, char **argv)
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1)
 	exit(1);
 
+    if (_data.backend != NULL && block_backend(_data.backend) < 0) {
+        printf("unknown block backend: %s\n", _data.backend);
+        exit(1);
+    }
+    if (_data.backend != NULL && strcmp(_data.backend, "mmap") == 0) {
+        if (_data.writeback) {
+            printf("-writeback needs the block cache, which is not used with -backend mmap\n");
+            exit(1);
+        }
+        if (_data.cache_mb != NULL && atoi(_data.cache_mb) != 0)
+            printf("WARNING: -cache is ignored with -backend mmap\n");
+    }
+    if (_data.cache_mb != NULL)
+        cache_budget((size_t)atoi(_data.cache_mb) << 20);
+    if (_data.ra_blocks != NULL)
+        readahead_max(atoi(_data.ra_blocks));
+    cache_writeback(_data.writeback);
     block_init(_data.image_name);
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    int val = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    block_sync();
+
+    struct cache_stats st;
+    cache_get_stats(&st);
+    printf("INFO: block cache %zu KB: %lu hits, %lu misses (%lu not cached), "
+           "%lu evictions, %lu write-backs\n", st.budget >> 10, st.hits,
+           st.misses, st.bypassed, st.evictions, st.writebacks);
+
+    struct ra_stats ra;
+    readahead_get_stats(&ra);
+    printf("INFO: read-ahead window %d/%d blocks: %lu sequential, %lu random, "
+           "%lu prefetched, %lu used\n", ra.window, ra.max_window,
+           ra.sequential, ra.random, st.prefetched, st.ra_hits);
+
+    struct dcache_stats dc;
+    dcache_get_stats(&dc);
+    printf("INFO: dentry cache %d entries (%d negative): %lu hits, %lu misses, "
+           "%lu evictions, %lu walks saved by negative entries\n", dc.entries,
+           dc.negative, dc.hits, dc.misses, dc.evictions, dc.neg_hits);
+
+    struct icache_stats ic;
+    icache_get_stats(&ic);
+    printf("INFO: inode cache %d entries: %lu hits, %lu misses, %lu evictions, "
+           "%lu write-backs\n", ic.entries, ic.hits, ic.misses, ic.evictions,
+           ic.writebacks);
+
+    struct dindex_stats di;
+    dindex_get_stats(&di);
+    printf("INFO: directory index: %lu indexed lookups, %lu scans, %lu builds\n",
+           di.indexed, di.scanned, di.builds);
+
+    struct balloc_stats ba;
+    balloc_get_stats(&ba);
+    printf("INFO: block allocator %d free in %d extents (largest %d) in %d of "
+           "%d groups loaded, %d counted at mount: %lu allocated in %lu runs, "
+           "%lu at their goal, %lu freed\n", ba.free, ba.free_extents,
+           ba.largest_free, ba.groups_loaded, ba.groups, ba.groups_counted,
+           ba.allocs, ba.runs, ba.goal_hits, ba.frees);
+    return val;
 }
@@ -0,0 +1,384 @@
+/*
+ * file:        icache.c
+ * description: inode metadata cache
+ *
+ * Holds the attribute part of recently used inodes (struct inode_meta,
+ * 20 bytes) keyed by inode number, so getattr, chmod and utime work on a
+ * small in-memory record instead of a 4 KB inode block. The block
+ * pointers stay in the inode block itself and are only read by the
+ * operations that need them.
+ *
+ * Entries are pinned with icache_get and released with icache_put; a
+ * pinned entry is never evicted. Changes made through a pinned entry
+ * mark it dirty. A dirty entry is folded back into its inode block when
+ * it is evicted or on icache_sync. If the buffer cache is not in
+ * write-back mode, that happens right away in icache_put, as it did
+ * before.
+ *
+ * Code that reads a whole inode must pass it through icache_merge so
+ * that it sees attributes that have not been written back yet. Code
+ * that writes a whole inode must do it with icache_write, so that the
+ * cached copy matches it and a write-back of the same entry cannot
+ * overlap it and put the older block back.
+ *
+ * icache_lock serializes the updates of one inode - a read of the
+ * inode, changes to it, and the write of the result - so that two
+ * threads cannot both start from the same copy. The locks are shared
+ * by inode number, so no thread holds more than one.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "icache.h"
+#include "cache.h"
+
+struct icache_entry {
+    struct inode_meta meta;     /* first: a meta pointer is an entry pointer */
+    int      inum;              /* 0 if free or forgotten */
+    int      next;              /* hash chain, -1 terminates */
+    int      refcount;
+    uint8_t  ref;               /* CLOCK reference bit */
+    uint8_t  dirty;             /* newer than the inode block */
+};
+
+static struct icache_entry entries[ICACHE_ENTRIES];
+static int buckets[ICACHE_ENTRIES];     /* heads of hash chains */
+static int hand;
+static int initialized;
+static struct icache_stats stats;
+static pthread_mutex_t ic_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t inode_locks[ICACHE_LOCKS] = {
+    [0 ... ICACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int *bucket_of(int inum)
+{
+    return &buckets[((uint32_t)inum * 0x9E3779B1u) % ICACHE_ENTRIES];
+}
+
+/* caller holds ic_lock
+ */
+static void icache_setup(void)
+{
+    if (initialized)
+    {
+        return;
+    }
+    memset(buckets, 0xff, sizeof(buckets));
+    for (int i = 0; i < ICACHE_ENTRIES; i++)
+    {
+        entries[i].next = -1;
+    }
+    initialized = 1;
+}
+
+static void meta_from_inode(struct inode_meta *meta, const struct fs_inode *inode)
+{
+    meta->uid = inode->uid;
+    meta->gid = inode->gid;
+    meta->mode = inode->mode;
+    meta->ctime = inode->ctime;
+    meta->mtime = inode->mtime;
+    meta->size = inode_size(inode);
+}
+
+static void meta_to_inode(struct fs_inode *inode, const struct inode_meta *meta)
+{
+    inode->uid = meta->uid;
+    inode->gid = meta->gid;
+    inode->mode = meta->mode;
+    inode->ctime = meta->ctime;
+    inode->mtime = meta->mtime;
+    inode_set_size(inode, meta->size);
+}
+
+/* entry index for 'inum', or -1. Caller holds ic_lock
+ */
+static int entry_lookup(int inum)
+{
+    for (int idx = *bucket_of(inum); idx >= 0; idx = entries[idx].next)
+    {
+        if (entries[idx].inum == inum)
+        {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void entry_unhash(int idx)
+{
+    int *pidx = bucket_of(entries[idx].inum);
+    while (*pidx != idx)
+    {
+        pidx = &entries[*pidx].next;
+    }
+    *pidx = entries[idx].next;
+    entries[idx].next = -1;
+    if (entries[idx].dirty)
+    {
+        entries[idx].dirty = 0;
+        stats.dirty--;
+    }
+    entries[idx].inum = 0;
+    stats.entries--;
+}
+
+/* fold a dirty entry back into its inode block. Caller holds ic_lock
+ */
+static int entry_writeback(struct icache_entry *e)
+{
+    struct fs_inode inode;
+    int status;
+    if ((status = cache_read_meta(&inode, e->inum)) < 0)
+    {
+        return status;
+    }
+    meta_to_inode(&inode, &e->meta);
+    if ((status = cache_write_meta(&inode, e->inum)) < 0)
+    {
+        return status;
+    }
+    e->dirty = 0;
+    stats.dirty--;
+    stats.writebacks++;
+    return 0;
+}
+
+/* claim an entry for 'inum', evicting with CLOCK if necessary; pinned
+ * entries are skipped and dirty ones written back first. Returns the
+ * index, or -ENOMEM if every entry is pinned. Caller holds ic_lock and
+ * has checked that 'inum' is not already cached.
+ */
+static int entry_claim(int inum)
+{
+    int idx = -1;
+    for (int n = 0; n < 2 * ICACHE_ENTRIES; n++)
+    {
+        struct icache_entry *e = &entries[hand];
+        int cur = hand;
+        hand = (hand + 1) % ICACHE_ENTRIES;
+        if (e->refcount > 0)
+        {
+            continue;
+        }
+        if (e->inum == 0)
+        {
+            idx = cur;
+            break;
+        }
+        if (e->ref)
+        {
+            e->ref = 0;
+            continue;
+        }
+        if (e->dirty && entry_writeback(e) < 0)
+        {
+            continue;
+        }
+        entry_unhash(cur);
+        stats.evictions++;
+        idx = cur;
+        break;
+    }
+    if (idx < 0)
+    {
+        return -ENOMEM;
+    }
+
+    int *head = bucket_of(inum);
+    entries[idx].inum = inum;
+    entries[idx].ref = 1;
+    entries[idx].dirty = 0;
+    entries[idx].next = *head;
+    *head = idx;
+    stats.entries++;
+    return idx;
+}
+
+/* pin the cached attributes of 'inum', reading its inode on a miss.
+ * Returns 0 or -errno; release with icache_put.
+ */
+int icache_get(int inum, struct inode_meta **meta)
+{
+    int idx, status = 0;
+    pthread_mutex_lock(&ic_lock);
+    icache_setup();
+    if ((idx = entry_lookup(inum)) >= 0)
+    {
+        stats.hits++;
+    }
+    else
+    {
+        struct fs_inode inodeBuf;
+        const struct fs_inode *inode;
+        stats.misses++;
+        if ((inode = cache_peek_meta(&inodeBuf, inum)) == NULL)
+        {
+            status = -EIO;
+        }
+        else if ((idx = entry_claim(inum)) < 0)
+        {
+            status = idx;
+        }
+        else
+        {
+            meta_from_inode(&entries[idx].meta, inode);
+        }
+    }
+    if (status == 0)
+    {
+        entries[idx].refcount++;
+        entries[idx].ref = 1;
+        *meta = &entries[idx].meta;
+    }
+    pthread_mutex_unlock(&ic_lock);
+    return status;
+}
+
+/* release an entry pinned by icache_get; 'dirty' if it was modified.
+ * Returns 0, or -errno if an immediate write-back failed.
+ */
+int icache_put(struct inode_meta *meta, int dirty)
+{
+    struct icache_entry *e = (struct icache_entry *)meta;
+    int status = 0;
+    pthread_mutex_lock(&ic_lock);
+    if (dirty && e->inum != 0)
+    {
+        if (!e->dirty)
+        {
+            e->dirty = 1;
+            stats.dirty++;
+        }
+        if (!cache_writing_back())
+        {
+            status = entry_writeback(e);
+        }
+    }
+    e->refcount--;
+    pthread_mutex_unlock(&ic_lock);
+    return status;
+}
+
+/* copy out the cached attributes of 'inum' without reading anything.
+ * Returns 1 if it was cached, 0 if not.
+ */
+int icache_lookup(int inum, struct inode_meta *meta)
+{
+    pthread_mutex_lock(&ic_lock);
+    icache_setup();
+    int idx = entry_lookup(inum);
+    if (idx >= 0)
+    {
+        memcpy(meta, &entries[idx].meta, sizeof(*meta));
+        entries[idx].ref = 1;
+        stats.hits++;
+    }
+    pthread_mutex_unlock(&ic_lock);
+    return idx >= 0;
+}
+
+/* 'inode' has just been read from disk: overlay any attributes held in
+ * the cache, or else cache the ones it has
+ */
+void icache_merge(int inum, struct fs_inode *inode)
+{
+    pthread_mutex_lock(&ic_lock);
+    icache_setup();
+    int idx = entry_lookup(inum);
+    if (idx >= 0)
+    {
+        meta_to_inode(inode, &entries[idx].meta);
+        entries[idx].ref = 1;
+    }
+    else if ((idx = entry_claim(inum)) >= 0)
+    {
+        meta_from_inode(&entries[idx].meta, inode);
+    }
+    pthread_mutex_unlock(&ic_lock);
+}
+
+/* write a whole inode; the cached copy (if any) is then clean. Returns
+ * 0 or -errno
+ */
+int icache_write(int inum, const struct fs_inode *inode)
+{
+    int status;
+    pthread_mutex_lock(&ic_lock);
+    icache_setup();
+    if ((status = cache_write_meta((void *)inode, inum)) < 0)
+    {
+        pthread_mutex_unlock(&ic_lock);
+        return status;
+    }
+    int idx = entry_lookup(inum);
+    if (idx < 0)
+    {
+        idx = entry_claim(inum);
+    }
+    if (idx >= 0)
+    {
+        meta_from_inode(&entries[idx].meta, inode);
+        if (entries[idx].dirty)
+        {
+            entries[idx].dirty = 0;
+            stats.dirty--;
+        }
+    }
+    pthread_mutex_unlock(&ic_lock);
+    return 0;
+}
+
+/* drop 'inum' without writing it back - its inode is being freed. An
+ * entry that is still pinned is only unhashed; icache_put releases it.
+ */
+void icache_forget(int inum)
+{
+    pthread_mutex_lock(&ic_lock);
+    icache_setup();
+    int idx = entry_lookup(inum);
+    if (idx >= 0)
+    {
+        entry_unhash(idx);
+    }
+    pthread_mutex_unlock(&ic_lock);
+}
+
+/* write every dirty entry back to its inode block. Returns 0 or the
+ * first error
+ */
+int icache_sync(void)
+{
+    int status = 0;
+    pthread_mutex_lock(&ic_lock);
+    for (int idx = 0; idx < ICACHE_ENTRIES && stats.dirty > 0; idx++)
+    {
+        if (entries[idx].inum != 0 && entries[idx].dirty)
+        {
+            int val = entry_writeback(&entries[idx]);
+            status = (status < 0) ? status : val;
+        }
+    }
+    pthread_mutex_unlock(&ic_lock);
+    return status;
+}
+
+void icache_get_stats(struct icache_stats *st)
+{
+    pthread_mutex_lock(&ic_lock);
+    memcpy(st, &stats, sizeof(*st));
+    pthread_mutex_unlock(&ic_lock);
+}
+
+void icache_lock(int inum)
+{
+    pthread_mutex_lock(&inode_locks[(uint32_t)inum % ICACHE_LOCKS]);
+}
+
+void icache_unlock(int inum)
+{
+    pthread_mutex_unlock(&inode_locks[(uint32_t)inum % ICACHE_LOCKS]);
+}
@@ -0,0 +1,46 @@
+/*
+ * file:        icache.h
+ * description: in-memory inode metadata cache
+ */
+#ifndef __ICACHE_H__
+#define __ICACHE_H__
+
+#include <stdint.h>
+
+#include "fs5600.h"
+
+#define ICACHE_ENTRIES 1024
+#define ICACHE_LOCKS 64         /* inode locks, shared by inode number */
+
+/* the attribute fields of struct fs_inode, without the block pointers
+ */
+struct inode_meta {
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t mode;
+    uint32_t ctime;
+    uint32_t mtime;
+    int64_t  size;
+};
+
+struct icache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;        /* dirty records written to their inode */
+    int      entries;
+    int      dirty;
+};
+
+int icache_get(int inum, struct inode_meta **meta);
+int icache_put(struct inode_meta *meta, int dirty);
+int icache_lookup(int inum, struct inode_meta *meta);
+void icache_merge(int inum, struct fs_inode *inode);
+int icache_write(int inum, const struct fs_inode *inode);
+void icache_forget(int inum);
+int icache_sync(void);
+void icache_get_stats(struct icache_stats *st);
+void icache_lock(int inum);
+void icache_unlock(int inum);
+
+#endif
@@ -8,6 +8,7 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
@@ -18,45 +19,275 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "fs5600.h"		/* only for FS_BLOCK_SIZE */
+#include "fs5600.h"		/* FS_BLOCK_SIZE, FS_MAX_BLOCK_SIZE */
+#include "misc.h"
 
-/*********** DO NOT MODIFY THIS FILE *************/
+/* the image's block size, from the superblock; see block_set_size
+ */
+int fs_block_size = FS_BLOCK_SIZE;
+int fs_block_shift = 12;
 
-/* All disk I/O is accessed through these functions
+/* All disk I/O is accessed through these functions. Everything uses
+ * positional I/O (pread/pwrite and friends), so there is no shared file
+ * offset and the functions can be called from several threads at once.
+ *
+ * With the "mmap" backend the whole image is mapped at block_init time;
+ * transfers become memcpy into/out of the mapping, and block_peek hands
+ * out pointers into it directly.
  */
 static int disk_fd;
+static int backend = BLOCK_BACKEND_PREAD;
+static char *disk_map;
+static size_t disk_len;
+static int use_uring;
+
+/* io_uring engine, in uring.c
+ */
+extern int uring_setup(int disk_fd);
+extern int uring_submit(struct block_req *req);
+extern int uring_wait_req(struct block_req *req);
+
+/* pointer to 'nblks' blocks at 'lba' in the mapping, or NULL if the
+ * range runs off the end of the image
+ */
+static char *map_addr(int lba, int nblks)
+{
+    size_t start = (size_t)lba << fs_block_shift;
+    size_t len = (size_t)nblks << fs_block_shift;
+
+    if (lba < 0 || start + len > disk_len)
+        return NULL;
+    return disk_map + start;
+}
 
 /* read blocks from disk image. Returns -EIO if error, 0 otherwise
  */
-int block_read(char *buf, int lba, int nblks)
+int block_read(void *buf, int lba, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    size_t len = (size_t)nblks << fs_block_shift;
+    off_t start = (off_t)lba << fs_block_shift;
 
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+    if (disk_map != NULL) {
+        char *addr = map_addr(lba, nblks);
+        if (addr == NULL)
+            return -EIO;
+        memcpy(buf, addr, len);
+        return 0;
+    }
+    if (pread(disk_fd, buf, len, start) != len)
         return -EIO;
-    if (read(disk_fd, buf, len) != len)
+    return 0;
+}
+
+/* read the superblock - its first FS_BLOCK_SIZE bytes, which is all of
+ * it at any block size
+ */
+int block_read_super(void *buf)
+{
+    if (disk_map != NULL) {
+        if (disk_len < FS_BLOCK_SIZE)
+            return -EIO;
+        memcpy(buf, disk_map, FS_BLOCK_SIZE);
+        return 0;
+    }
+    if (pread(disk_fd, buf, FS_BLOCK_SIZE, 0) != FS_BLOCK_SIZE)
+        return -EIO;
+    return 0;
+}
+
+static int write_bytes(void *buf, off_t start, size_t len)
+{
+    if (disk_map != NULL) {
+        if (start < 0 || start + len > disk_len)
+            return -EIO;
+        memcpy(disk_map + start, buf, len);
+        return 0;
+    }
+    if (pwrite(disk_fd, buf, len, start) != len)
         return -EIO;
     return 0;
 }
 
 /* write blocks from disk image. Returns -EIO if error, 0 otherwise
  */
-int block_write(char *buf, int lba, int nblks)
+int block_write(void *buf, int lba, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
-
     assert(lba > 0);		/* write to 0 is *always* an error */
-    
-    /* Seek to the *end* of the region being written, to make sure it
-     * all fits on the disk image. Then seek to write location.
-     */
-    if (lseek(disk_fd, start + len, SEEK_SET) < 0)
-        return -EIO;
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
-        return -EIO;
-    if (write(disk_fd, buf, len) != len)
-        return -EIO;
+    return write_bytes(buf, (off_t)lba << fs_block_shift,
+                       (size_t)nblks << fs_block_shift);
+}
+
+/* write the superblock, the one block block_write refuses. Only its
+ * first FS_BLOCK_SIZE bytes are written, whatever the block size.
+ */
+int block_write_super(void *buf)
+{
+    return write_bytes(buf, 0, FS_BLOCK_SIZE);
+}
+
+/* set the block size for all transfers; a power of two from FS_BLOCK_SIZE
+ * to FS_MAX_BLOCK_SIZE. Must be called before anything is cached.
+ * Returns -EINVAL for an unsupported size.
+ */
+int block_set_size(int bytes)
+{
+    int shift = 0;
+
+    if (bytes < FS_BLOCK_SIZE || bytes > FS_MAX_BLOCK_SIZE ||
+        (bytes & (bytes - 1)) != 0)
+        return -EINVAL;
+    while ((1 << shift) < bytes)
+        shift++;
+    fs_block_size = bytes;
+    fs_block_shift = shift;
+    return 0;
+}
+
+/* read-only access to a single block. Returns a pointer to the block's
+ * contents - straight into the mapping for the mmap backend, otherwise
+ * 'scratch' (fs_block_size bytes) after reading the block into it - or
+ * NULL on error. The result must not be written through.
+ */
+const void *block_peek(void *scratch, int lba)
+{
+    if (disk_map != NULL)
+        return map_addr(lba, 1);
+    if (block_read(scratch, lba, 1) < 0)
+        return NULL;
+    return scratch;
+}
+
+/* Transfer a vector of blocks. Consecutive elements whose LBAs are
+ * consecutive are gathered into one preadv/pwritev call (up to IOV_MAX
+ * blocks each), so a run of contiguous blocks costs a single syscall.
+ */
+static int block_xferv(struct block_iov *iov, int n, int write)
+{
+    struct iovec vec[IOV_MAX];
+
+    if (disk_map != NULL) {
+        for (int i = 0; i < n; i++) {
+            int val = write ? block_write(iov[i].buf, iov[i].lba, 1) :
+                block_read(iov[i].buf, iov[i].lba, 1);
+            if (val < 0)
+                return val;
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < n; )
+    {
+        int lba = iov[i].lba, cnt = 0;
+        while (i < n && cnt < IOV_MAX && iov[i].lba == lba + cnt)
+        {
+            assert(!write || iov[i].lba > 0);
+            vec[cnt].iov_base = iov[i].buf;
+            vec[cnt].iov_len = fs_block_size;
+            cnt++, i++;
+        }
+        ssize_t len = (ssize_t)cnt << fs_block_shift;
+        off_t start = (off_t)lba << fs_block_shift;
+        ssize_t val = write ? pwritev(disk_fd, vec, cnt, start) :
+            preadv(disk_fd, vec, cnt, start);
+        if (val != len)
+            return -EIO;
+    }
+    return 0;
+}
+
+/* start an asynchronous vectored transfer. Without io_uring the transfer
+ * is simply done synchronously here. Returns -EIO if error, 0 otherwise
+ */
+int block_submit(struct block_req *req)
+{
+    if (use_uring)
+        return uring_submit(req);
+    req->pending = 0;
+    req->priv = NULL;
+    return req->status = block_xferv(req->iov, req->n, req->write);
+}
+
+/* wait for a transfer started by block_submit. Returns -EIO if any part
+ * of it failed, 0 otherwise
+ */
+int block_complete(struct block_req *req)
+{
+    if (use_uring)
+        return uring_wait_req(req);
+    return req->status;
+}
+
+static int block_rwv(struct block_iov *iov, int n, int write)
+{
+    if (!use_uring)
+        return block_xferv(iov, n, write);
+
+    struct block_req req = {.iov = iov, .n = n, .write = write};
+    block_submit(&req);
+    return block_complete(&req);
+}
+
+/* read a vector of (lba, buffer) pairs. Returns -EIO if error, 0 otherwise
+ */
+int block_readv(struct block_iov *iov, int n)
+{
+    return block_rwv(iov, n, 0);
+}
+
+/* write a vector of (lba, buffer) pairs. Returns -EIO if error, 0 otherwise
+ */
+int block_writev(struct block_iov *iov, int n)
+{
+    return block_rwv(iov, n, 1);
+}
+
+/* true if the image is memory-mapped (block_peek never copies)
+ */
+int block_mapped(void)
+{
+    return disk_map != NULL;
+}
+
+/* make everything written so far durable - msync for the mapping,
+ * fsync otherwise. Returns -EIO if error, 0 otherwise
+ */
+int block_sync(void)
+{
+    if (disk_map != NULL)
+        return (msync(disk_map, disk_len, MS_SYNC) < 0) ? -EIO : 0;
+    return (fsync(disk_fd) < 0) ? -EIO : 0;
+}
+
+/* start writing back everything written so far, without waiting for
+ * it - msync(MS_ASYNC) for the mapping. pwrite has already handed the
+ * data to the kernel, so there is nothing to do otherwise. Returns -EIO
+ * if error, 0 otherwise
+ */
+int block_flush(void)
+{
+    if (disk_map != NULL)
+        return (msync(disk_map, disk_len, MS_ASYNC) < 0) ? -EIO : 0;
+    return 0;
+}
+
+/* select the I/O backend by name ("pread", "mmap" or "uring"); must be
+ * called before block_init. Returns -EINVAL for an unknown name.
+ */
+int block_backend(const char *name)
+{
+    if (strcmp(name, "pread") == 0)
+        backend = BLOCK_BACKEND_PREAD;
+    else if (strcmp(name, "mmap") == 0)
+        backend = BLOCK_BACKEND_MMAP;
+    else if (strcmp(name, "uring") == 0)
+        backend = BLOCK_BACKEND_URING;
+    else
+        return -EINVAL;
     return 0;
 }
 
@@ -70,4 +301,25 @@ void block_init(char *file)
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         exit(1);
     }
+
+    if (backend == BLOCK_BACKEND_MMAP) {
+        struct stat sb;
+        if (fstat(disk_fd, &sb) < 0) {
+            printf("cannot stat image file '%s': %s\n", file, strerror(errno));
+            exit(1);
+        }
+        disk_len = sb.st_size;
+        disk_map = mmap(NULL, disk_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        disk_fd, 0);
+        if (disk_map == MAP_FAILED) {
+            printf("cannot map image file '%s': %s\n", file, strerror(errno));
+            exit(1);
+        }
+    }
+    if (backend == BLOCK_BACKEND_URING) {
+        int val = uring_setup(disk_fd);
+        if (val < 0)
+            printf("io_uring unavailable (%s), using pread\n", strerror(-val));
+        use_uring = (val == 0);
+    }
 }
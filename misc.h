@@ -0,0 +1,62 @@
+/*
+ * file:        misc.h
+ * description: block device interface provided by misc.c
+ *
+ * All disk I/O is in terms of fs_block_size blocks - FS_BLOCK_SIZE
+ * unless the superblock says otherwise; every function returns 0
+ * (success) or -EIO.
+ */
+#ifndef __MISC_H__
+#define __MISC_H__
+
+/* One element of a vectored transfer: block 'lba' is read into / written
+ * from the fs_block_size bytes at 'buf'. Runs of consecutive LBAs in a
+ * vector are sent to the disk as a single request.
+ */
+struct block_iov {
+    int   lba;
+    void *buf;
+};
+
+/* An asynchronous vectored transfer. Fill in iov/n/write, start it with
+ * block_submit() and retire it with block_complete(), which must be called
+ * even if block_submit() failed. The iov array and buffers must stay
+ * valid until block_complete() returns.
+ */
+struct block_req {
+    struct block_iov *iov;
+    int   n;
+    int   write;
+    int   pending;          /* engine-private from here on */
+    int   status;
+    void *priv;
+};
+
+/* I/O backends, selected with block_backend() before block_init()
+ */
+#define BLOCK_BACKEND_PREAD 0   /* pread/pwrite on the image file */
+#define BLOCK_BACKEND_MMAP  1   /* whole image mapped into memory */
+#define BLOCK_BACKEND_URING 2   /* io_uring, falls back to pread */
+
+extern int fs_block_size;        /* bytes */
+extern int fs_block_shift;       /* log2(fs_block_size) */
+
+int block_read(void *buf, int lba, int nblks);
+int block_write(void *buf, int lba, int nblks);
+int block_read_super(void *buf);
+int block_write_super(void *buf);
+int block_readv(struct block_iov *iov, int n);
+int block_writev(struct block_iov *iov, int n);
+int block_submit(struct block_req *req);
+int block_complete(struct block_req *req);
+const void *block_peek(void *scratch, int lba);
+int block_mapped(void);
+int block_sync(void);
+int block_flush(void);
+
+int block_backend(const char *name);
+int block_set_size(int bytes);
+
+void block_init(char *file);
+
+#endif
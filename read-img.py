@@ -5,20 +5,33 @@ import diskfmt as fs
 
 fd = os.open(sys.argv[1], os.O_RDONLY)
 nbytes = os.fstat(fd).st_size
-if nbytes % 4096 != 0:
+sb = fs.super.from_buffer_copy(os.read(fd, 4096))
+bsize = fs.block_size(sb)
+if nbytes % bsize != 0:
     print 'BAD LENGTH: %d (0x%x)' % (nbytes, nbytes)
     sys.exit(1)
 
-nblks = nbytes // 4096
-blks = [bytes(os.read(fd, 4096)) for _ in range(nblks)]
-sb = fs.super.from_buffer_copy(blks[0])
+# metadata is always in the first 4096 bytes of its block
+nblks = nbytes // bsize
+os.lseek(fd, 0, os.SEEK_SET)
+blks = [bytes(os.read(fd, bsize))[0:4096] for _ in range(nblks)]
 print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
+print '            block size: %d' % bsize
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+
+blkmap = fs.blockmap(sb, blks[0:sb.disk_sz])
+
+# after a clean unmount the saved free counts must match the bitmaps
+nfree = nblks - sum(1 for i in range(nblks) if blkmap.get(i))
+if sb.state == fs.STATE_CLEAN:
+    print ('            clean, %d free%s' %
+               (sb.free_blocks, (' *BAD* %d' % nfree) if sb.free_blocks != nfree else ''))
+else:
+    print '            not cleanly unmounted, %d free' % nfree
 print
 
-blkmap = fs.bitmap.from_buffer_copy(blks[1])
 inodes = dict()
 
 print("blocks used:"),
@@ -46,20 +59,39 @@ def iter(name, inum, v):
     if v:
         print 'inode %d:' % inum
         print '  "%s" (%d,%d) %03o %d %s' % (s, _in.uid, _in.gid, _in.mode,
-                                                 _in.size, alloc)
+                                                 fs.file_size(_in), alloc)
     
-    xblks = (_in.size + 4095) // 4096
+    xblks = (_in.size + 4095) // 4096      # directory blocks hold 4096 bytes
+    if fs.S_ISREG(_in.mode) and not v:
+        fblks = [b for b in fs.file_blocks(_in, bsize) if b != 0]
+        files[inum] = sum(1 for i in range(len(fblks))
+                              if i == 0 or fblks[i] != fblks[i-1] + 1)
     if fs.S_ISREG(_in.mode):
         if v:
+            if _in.mode & fs.FS_INODE_EXTENTS:
+                print '  extents:', ' '.join('%d+%d' % (_in.ptrs[2 + 2*i], _in.ptrs[3 + 2*i])
+                                                for i in range(_in.ptrs[1]))
             print '  blocks: ',
-        for i in range(xblks):
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+        hole = 0
+        for b in fs.file_blocks(_in, bsize) + [None]:
+            if b == 0:
+                hole += 1
+                continue
+            if v and hole:
+                print 'hole+%d' % hole,
+            hole = 0
+            if b is None:
+                break
+            alloc = '' if blkmap.get(b) else '(NOT ALLOCATED)'
             if v:
-                print str(_in.ptrs[i]) + alloc,
+                print str(b) + alloc,
         if v:
             print
     elif fs.S_ISDIR(_in.mode):
-        for i in range(xblks):
+        first = 1 if _in.mode & fs.FS_DIR_INDEXED else 0
+        if v and first:
+            print '  index', _in.ptrs[0]
+        for i in range(first, xblks):
             dblk = _in.ptrs[i]
             alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
             if v:
@@ -82,6 +114,7 @@ def iter(name, inum, v):
     for n,i in children:
         iter(n,i, v)
 
+files = dict()
 iter('', 2, False)
 
 print "inodes found:",
@@ -96,5 +129,11 @@ for i in range(nblks):
         e = ''
 print '\n'
 
+# fragmentation: how many runs of consecutive blocks files are stored in
+nfiles = sum(1 for n in files.values() if n > 0)
+nextents = sum(files.values())
+print 'fragmentation: %d extents in %d non-empty files, %.2f per file\n' % (
+    nextents, nfiles, float(nextents) / nfiles if nfiles else 0.0)
+
 iter('', 2, True)
 
@@ -0,0 +1,104 @@
+/*
+ * file:        readahead.c
+ * description: per-file sequential read detection
+ *
+ * Each file being read has a stream recording where its last read
+ * ended. A read starting there is sequential and doubles the stream's
+ * window, up to the configured maximum; any other read collapses the
+ * window to nothing. The window is the number of blocks past the end of
+ * the current read that should already be in the buffer cache; it is
+ * topped up whenever less than half of it remains, so a steady
+ * sequential reader fetches in batches of at least half a window instead
+ * of one round trip per FUSE request.
+ *
+ * An open file handle carries its own stream, so two readers of the
+ * same file do not disturb each other. Reads without a handle use a
+ * small direct-mapped table indexed by inode number. A collision simply
+ * restarts the stream, so this is only ever a hint - correctness never
+ * depends on it.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "readahead.h"
+
+#define RA_STREAMS 64           /* power of 2 */
+
+static struct ra_stream streams[RA_STREAMS];
+static int max_window = RA_DEFAULT_MAX;
+static struct ra_stats stats;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* note a read of blocks [blk, blk+nblks) of a file 'fileblks' blocks long,
+ * on stream 'st' (NULL for the shared table), and decide what to
+ * prefetch. Returns the number of blocks to fetch, starting at file block
+ * '*start'; 0 if nothing is needed.
+ */
+int readahead(struct ra_stream *st, int inum, int blk, int nblks, int fileblks,
+              int *start)
+{
+    if (st == NULL)
+    {
+        st = &streams[inum & (RA_STREAMS - 1)];
+    }
+    int end = blk + nblks, n = 0;
+
+    pthread_mutex_lock(&ra_lock);
+    if (max_window == 0)
+    {
+        pthread_mutex_unlock(&ra_lock);
+        return 0;
+    }
+    if (st->inum == inum && blk == st->next)
+    {
+        st->window = (st->window == 0) ? RA_MIN_WINDOW : st->window * 2;
+        if (st->window > max_window)
+        {
+            st->window = max_window;
+        }
+        stats.sequential++;
+    }
+    else
+    {
+        // a read from the start of a file is most likely the first of many
+        st->window = (blk == 0) ? RA_MIN_WINDOW : 0;
+        st->ahead = end;
+        stats.random++;
+    }
+    st->inum = inum;
+    st->next = end;
+    if (st->ahead < end)
+    {
+        st->ahead = end;
+    }
+
+    int limit = (end + st->window < fileblks) ? end + st->window : fileblks;
+    if (st->window > 0 && st->ahead - end <= st->window / 2 && st->ahead < limit)
+    {
+        *start = st->ahead;
+        n = limit - st->ahead;
+        st->ahead = limit;
+        stats.refills++;
+    }
+    stats.window = st->window;
+    pthread_mutex_unlock(&ra_lock);
+    return n;
+}
+
+/* largest window in blocks; 0 disables read-ahead
+ */
+void readahead_max(int blocks)
+{
+    pthread_mutex_lock(&ra_lock);
+    max_window = (blocks < 0) ? 0 : blocks;
+    pthread_mutex_unlock(&ra_lock);
+}
+
+void readahead_get_stats(struct ra_stats *st)
+{
+    pthread_mutex_lock(&ra_lock);
+    memcpy(st, &stats, sizeof(*st));
+    st->max_window = max_window;
+    pthread_mutex_unlock(&ra_lock);
+}
@@ -0,0 +1,36 @@
+/*
+ * file:        readahead.h
+ * description: sequential read detection for fs_read
+ */
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <stdint.h>
+
+#define RA_MIN_WINDOW 4         /* blocks, first window of a stream */
+#define RA_DEFAULT_MAX 64       /* blocks, largest window */
+
+/* one sequential reader: an open file handle embeds its own, reads
+ * without a handle share a small table (see readahead.c)
+ */
+struct ra_stream {
+    int inum;                   /* 0 if unused */
+    int next;                   /* block where the last read ended */
+    int ahead;                  /* blocks before this are prefetched */
+    int window;
+};
+
+struct ra_stats {
+    uint64_t sequential;        /* reads continuing where the last one ended */
+    uint64_t random;            /* reads that reset their stream */
+    uint64_t refills;           /* prefetches issued */
+    int      window;            /* current window of the last stream used */
+    int      max_window;        /* blocks, 0 if read-ahead is disabled */
+};
+
+int readahead(struct ra_stream *st, int inum, int blk, int nblks, int fileblks,
+              int *start);
+void readahead_max(int blocks);
+void readahead_get_stats(struct ra_stats *st);
+
+#endif
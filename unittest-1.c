@@ -14,6 +14,10 @@
 #include <fuse.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "cache.h"
 
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
@@ -300,6 +304,115 @@ START_TEST(rename_test)
 }
 END_TEST
 
+/* the block cache: a block read for the first time misses and is then
+ * found, and a file read before comes entirely from the cache. Nothing
+ * to count with the mapped image, which has no cache
+ */
+START_TEST(cache_stats_test)
+{
+    struct cache_stats before, after;
+    char buf[4096];
+    cache_get_stats(&before);
+    if (before.budget == 0)
+    {
+        return;
+    }
+    // block 300 is free (see disk1.in), so nothing has read it yet
+    ck_assert_int_eq(cache_read(buf, 300, 1), 0);
+    ck_assert_int_eq(cache_read(buf, 300, 1), 0);
+    cache_get_stats(&after);
+    ck_assert_int_eq(after.misses - before.misses, 1);
+    ck_assert_int_eq(after.hits - before.hits, 1);
+
+    ck_assert_int_eq(fs_ops.read("/file.12k+", file_bfr, 20000, 0, NULL), 12289);
+    cache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.read("/file.12k+", file_bfr, 20000, 0, NULL), 12289);
+    cache_get_stats(&after);
+    ck_assert_int_eq(after.misses, before.misses);
+    ck_assert_int_ge(after.hits - before.hits, 4);
+    ck_assert_int_eq(crc32(0, (unsigned char *)file_bfr, 12289), 4101348955);
+}
+END_TEST
+
+/* many threads with requests in flight at once, each checking what it
+ * reads against a copy of the image read up front. With the uring
+ * backend one thread's completions are often reaped by another.
+ */
+#define IMAGE_BLOCKS 400
+#define PARALLEL_THREADS 8
+#define PARALLEL_RUNS 16
+
+static char image_copy[IMAGE_BLOCKS * 4096];
+
+static void *parallel_reader(void *arg)
+{
+    unsigned seed = (uintptr_t)arg;
+    char (*bufs)[PARALLEL_RUNS * 4][4096] = malloc(2 * sizeof(*bufs));
+    long errors = 0;
+    for (int iter = 0; iter < 200; iter++)
+    {
+        struct block_iov iov[2][PARALLEL_RUNS * 4];
+        struct block_req req[2];
+        for (int r = 0; r < 2; r++)
+        {
+            // runs of 1-4 blocks at random places
+            int n = 0;
+            for (int run = 0; run < PARALLEL_RUNS; run++)
+            {
+                int len = 1 + rand_r(&seed) % 4;
+                int lba = rand_r(&seed) % (IMAGE_BLOCKS - len);
+                for (int i = 0; i < len; i++, n++)
+                {
+                    iov[r][n].lba = lba + i;
+                    iov[r][n].buf = bufs[r][n];
+                }
+            }
+            req[r] = (struct block_req){.iov = iov[r], .n = n, .write = 0};
+            block_submit(&req[r]);
+        }
+        for (int r = 0; r < 2; r++)
+        {
+            if (block_complete(&req[r]) < 0)
+            {
+                errors++;
+                continue;
+            }
+            for (int i = 0; i < req[r].n; i++)
+            {
+                if (memcmp(iov[r][i].buf, image_copy + iov[r][i].lba * 4096, 4096) != 0)
+                {
+                    errors++;
+                }
+            }
+        }
+    }
+    free(bufs);
+    return (void *)errors;
+}
+
+START_TEST(parallel_read_test)
+{
+    struct block_iov iov[IMAGE_BLOCKS];
+    for (int i = 0; i < IMAGE_BLOCKS; i++)
+    {
+        iov[i].lba = i;
+        iov[i].buf = image_copy + i * 4096;
+    }
+    ck_assert_int_eq(block_readv(iov, IMAGE_BLOCKS), 0);
+
+    pthread_t threads[PARALLEL_THREADS];
+    for (int t = 0; t < PARALLEL_THREADS; t++)
+    {
+        ck_assert_int_eq(pthread_create(&threads[t], NULL, parallel_reader, (void *)(uintptr_t)(t + 1)), 0);
+    }
+    for (int t = 0; t < PARALLEL_THREADS; t++)
+    {
+        void *errors;
+        pthread_join(threads[t], &errors);
+        ck_assert_int_eq((long)errors, 0);
+    }
+}
+END_TEST
 
 /* note that your tests will call:
  *  fs_ops.getattr(path, struct stat *sb)
@@ -311,6 +424,20 @@ END_TEST
 int main(int argc, char **argv)
 {
     system("python2 gen-disk.py -q disk1.in test.img");
+    // optional: the block backend, and "writeback" for a write-back
+    // cache; "make check" runs the combinations
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "writeback") == 0)
+        {
+            cache_writeback(1);
+        }
+        else if (block_backend(argv[i]) < 0)
+        {
+            printf("usage: %s [pread|mmap|uring] [writeback]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
     block_init("test.img");
     fs_ops.init(NULL);
 
@@ -327,6 +454,8 @@ int main(int argc, char **argv)
     tcase_add_test(tc, statfs_test);      /* statvfs tests */
     tcase_add_test(tc, chmod_test);       /* chmod tests */
     tcase_add_test(tc, rename_test);       /* rename tests */
+    tcase_add_test(tc, cache_stats_test);   /* block cache hits and misses */
+    tcase_add_test(tc, parallel_read_test); /* block reads from many threads */
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);
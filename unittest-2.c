@@ -15,6 +15,14 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#include "fs5600.h"
+#include "cache.h"
+#include "dcache.h"
+#include "dindex.h"
+#include "icache.h"
+#include "balloc.h"
+#include "readahead.h"
+
 // vscode issue
 #define MY_S_IFREG 0100000
 
@@ -29,6 +37,8 @@ struct fuse_context *fuse_get_context(void)
 
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
+extern void gather_run_timer(int all);
+extern int path_to_inum(const char *path, int depth);
 
 struct dir_test_data
 {
@@ -354,11 +364,31 @@ START_TEST(write_append_test)
     ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0777, NULL), 0);
     ck_assert_int_eq(fs_ops.write("/xxx", test_buffer, 100, 0, NULL), -ENOENT);
     ck_assert_int_eq(fs_ops.write("/append-dir", test_buffer, 100, 0, NULL), -EISDIR);
-    ck_assert_int_eq(fs_ops.write(fn, test_buffer, 100, 100, NULL), -EINVAL);
     ck_assert_int_eq(fs_ops.unlink(fn), 0); // clean up after yourself, and verify disk is ok
     ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
     ck_assert_int_eq(fsstats.f_bavail, free_blocks - 2);
 
+    // writing past the end leaves a hole, which reads as zeros and only
+    // the blocks actually written take space
+    char hole_buffer[3 * block_size];
+    ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0777, NULL), 0);
+    ck_assert_int_eq(fs_ops.write(fn, test_buffer, 100, 100, NULL), 100);
+    ck_assert_int_eq(fs_ops.write(fn, test_buffer, 100, 2 * block_size + 50, NULL), 100);
+    ck_assert_int_eq(fs_ops.getattr(fn, &filestat), 0);
+    ck_assert_int_eq(filestat.st_size, 2 * block_size + 150);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks - 3 - 2);
+    ck_assert_int_eq(fs_ops.read(fn, hole_buffer, 3 * block_size, 0, NULL), 2 * block_size + 150);
+    for (int i = 0; i < 2 * block_size + 150; i++)
+    {
+        char expect = (i >= 100 && i < 200) ? test_buffer[i - 100] :
+                      (i >= 2 * block_size + 50) ? test_buffer[i - 2 * block_size - 50] : 0;
+        ck_assert_int_eq(hole_buffer[i], expect);
+    }
+    ck_assert_int_eq(fs_ops.unlink(fn), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks - 2);
+
     // and on to the real tests - iterate over file size and incremental write size
     // create a file, fill it up (by appending one block after another), then validate that it was written correctly, then remove the file
     for (int *fs = file_size; *fs > 0; fs++)
@@ -521,6 +551,23 @@ START_TEST(write_truncate_test)
     ck_assert_int_eq(fs_ops.truncate("/xxx", 0), -ENOENT);
     ck_assert_int_eq(fs_ops.truncate("/truncate-dir", 0), -EISDIR);
     ck_assert_int_eq(fs_ops.truncate(fn, -10), -EINVAL);
+
+    // growing a file adds a hole and no blocks; data written past the old
+    // end of its last block is zero when it comes back into view
+    char trunc_buffer[2 * block_size];
+    memset(trunc_buffer, 'x', sizeof(trunc_buffer));
+    ck_assert_int_eq(fs_ops.write(fn, trunc_buffer, 1000, 0, NULL), 1000);
+    ck_assert_int_eq(fs_ops.truncate(fn, 500), 0);
+    ck_assert_int_eq(fs_ops.truncate(fn, 10 * block_size), 0);
+    ck_assert_int_eq(fs_ops.getattr(fn, &filestat), 0);
+    ck_assert_int_eq(filestat.st_size, 10 * block_size);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks - 3 - 1);
+    ck_assert_int_eq(fs_ops.read(fn, trunc_buffer, 2 * block_size, 0, NULL), 2 * block_size);
+    for (int i = 0; i < 2 * block_size; i++)
+    {
+        ck_assert_int_eq(trunc_buffer[i], i < 500 ? 'x' : 0);
+    }
     ck_assert_int_eq(fs_ops.unlink(fn), 0); // clean up after yourself, and verify disk is ok
     ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
     ck_assert_int_eq(fsstats.f_bavail, free_blocks - 2);
@@ -576,9 +623,734 @@ START_TEST(write_truncate_test)
 }
 END_TEST
 
+/* readdir filler that counts entries
+ */
+int count_filler(void *ptr, const char *name, const struct stat *st, off_t off)
+{
+    (*(int *)ptr)++;
+    return 0;
+}
+
+/* a full linear directory that cannot be indexed for lack of space is
+ * left as it was, and nothing is allocated
+ */
+START_TEST(dir_index_full_disk_test)
+{
+    int block_size = 4096;
+    char name[64], buf[block_size];
+    memset(buf, 'f', block_size);
+    struct stat filestat;
+    struct statvfs fsstats;
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int free_blocks = fsstats.f_bavail;
+
+    ck_assert_int_eq(fs_ops.mkdir("/full-dir", 0777), 0);
+    for (int i = 0; i < 128; i++)
+    {
+        sprintf(name, "/full-dir/f%d", i);
+        ck_assert_int_eq(fs_ops.create(name, MY_S_IFREG | 0777, NULL), 0);
+    }
+    ck_assert_int_eq(fs_ops.create("/fill.fil", MY_S_IFREG | 0777, NULL), 0);
+    int status;
+    off_t off = 0;
+    while ((status = fs_ops.write("/fill.fil", buf, block_size, off, NULL)) == block_size)
+    {
+        off += block_size;
+    }
+    ck_assert_int_eq(status, -ENOSPC);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int full_free = fsstats.f_bavail;
+
+    ck_assert_int_eq(fs_ops.create("/full-dir/one-more", MY_S_IFREG | 0777, NULL), -ENOSPC);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, full_free);
+    int count = 0;
+    ck_assert_int_eq(fs_ops.readdir("/full-dir", &count, count_filler, 0, NULL), 0);
+    ck_assert_int_eq(count, 128);
+    for (int i = 0; i < 128; i++)
+    {
+        sprintf(name, "/full-dir/f%d", i);
+        ck_assert_int_eq(fs_ops.getattr(name, &filestat), 0);
+    }
+
+    // with room again the directory is indexed, and holds one more
+    ck_assert_int_eq(fs_ops.unlink("/fill.fil"), 0);
+    ck_assert_int_eq(fs_ops.create("/full-dir/one-more", MY_S_IFREG | 0777, NULL), 0);
+    count = 0;
+    ck_assert_int_eq(fs_ops.readdir("/full-dir", &count, count_filler, 0, NULL), 0);
+    ck_assert_int_eq(count, 129);
+
+    ck_assert_int_eq(fs_ops.unlink("/full-dir/one-more"), 0);
+    for (int i = 0; i < 128; i++)
+    {
+        sprintf(name, "/full-dir/f%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/full-dir"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks);
+}
+END_TEST
+
+/* readdir filler that records the size of "gather.fil"
+ */
+int gather_size_filler(void *ptr, const char *name, const struct stat *st, off_t off)
+{
+    if (strcmp(name, "gather.fil") == 0)
+    {
+        *(off_t *)ptr = st->st_size;
+    }
+    return 0;
+}
+
+/* small appends through an open file are gathered in its handle and
+ * written out later; everything else must see them before that
+ */
+START_TEST(write_gather_test)
+{
+    int block_size = 4096;
+    int total = 40000;
+    char *fn = "/gather.fil";
+    char expect[total], buf[total];
+    init_test_data(expect, total, 119, -1);
+
+    struct fuse_file_info fi = {0};
+    struct stat filestat;
+    struct statvfs fsstats;
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int free_blocks = fsstats.f_bavail;
+
+    ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0777, &fi), 0);
+    for (int off = 0; off < 30000; off += 100)
+    {
+        ck_assert_int_eq(fs_ops.write(fn, expect + off, 100, off, &fi), 100);
+    }
+    // by path, with the appends most likely still in the handle
+    off_t listed_size = -1;
+    ck_assert_int_eq(fs_ops.readdir("/", &listed_size, gather_size_filler, 0, NULL), 0);
+    ck_assert_int_eq(listed_size, 30000);
+    ck_assert_int_eq(fs_ops.getattr(fn, &filestat), 0);
+    ck_assert_int_eq(filestat.st_size, 30000);
+    ck_assert_int_eq(fs_ops.read(fn, buf, total, 0, NULL), 30000);
+    ck_assert(memcmp(buf, expect, 30000) == 0);
+
+    // a truncate cuts through gathered data, and appends go on from there
+    for (int off = 30000; off < 38000; off += 100)
+    {
+        ck_assert_int_eq(fs_ops.write(fn, expect + off, 100, off, &fi), 100);
+    }
+    ck_assert_int_eq(fs_ops.truncate(fn, 35000), 0);
+    ck_assert_int_eq(fs_ops.getattr(fn, &filestat), 0);
+    ck_assert_int_eq(filestat.st_size, 35000);
+    for (int off = 35000; off < total; off += 100)
+    {
+        ck_assert_int_eq(fs_ops.write(fn, expect + off, 100, off, &fi), 100);
+    }
+
+    ck_assert_int_eq(fs_ops.release(fn, &fi), 0);
+    ck_assert_int_eq(fs_ops.getattr(fn, &filestat), 0);
+    ck_assert_int_eq(filestat.st_size, total);
+    ck_assert_int_eq(fs_ops.read(fn, buf, total, 0, NULL), total);
+    ck_assert(memcmp(buf, expect, total) == 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks - 1 - (total - 1) / block_size - 1);
+
+    ck_assert_int_eq(fs_ops.unlink(fn), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks);
+}
+END_TEST
+
+/* a gathered write-out done by the timer has nobody to return its error
+ * to, so the next flush of the handle does
+ */
+START_TEST(write_gather_error_test)
+{
+    int block_size = 4096;
+    char *fn = "/gather-err.fil";
+    char *fill = "/fill.fil";
+    char buf[block_size];
+    memset(buf, 'g', block_size);
+
+    struct fuse_file_info fi = {0};
+    struct stat filestat;
+    struct statvfs fsstats;
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int free_blocks = fsstats.f_bavail;
+
+    ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0777, &fi), 0);
+    ck_assert_int_eq(fs_ops.create(fill, MY_S_IFREG | 0777, NULL), 0);
+    int status;
+    off_t off = 0;
+    while ((status = fs_ops.write(fill, buf, block_size, off, NULL)) == block_size)
+    {
+        off += block_size;
+    }
+    ck_assert_int_eq(status, -ENOSPC);
+
+    // taken into the handle, then written out by the timer, which fails
+    ck_assert_int_eq(fs_ops.write(fn, buf, 100, 0, &fi), 100);
+    gather_run_timer(1);
+    ck_assert_int_eq(fs_ops.flush(fn, &fi), -ENOSPC);
+    ck_assert_int_eq(fs_ops.flush(fn, &fi), 0);
+    ck_assert_int_eq(fs_ops.getattr(fn, &filestat), 0);
+    ck_assert_int_eq(filestat.st_size, 0);
+
+    ck_assert_int_eq(fs_ops.release(fn, &fi), 0);
+    ck_assert_int_eq(fs_ops.unlink(fn), 0);
+    ck_assert_int_eq(fs_ops.unlink(fill), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bavail, free_blocks);
+}
+END_TEST
+
+/* is this block of data anywhere in the image itself, below the cache?
+ */
+static int on_disk(const char *data)
+{
+    char blk[4096];
+    for (int lba = 0; lba < 400; lba++)
+    {
+        if (block_read(blk, lba, 1) == 0 && memcmp(blk, data, sizeof(blk)) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* with a write-back cache, written blocks stay dirty in the cache until
+ * fsync sends them to disk. A write-through cache, and the mapped image,
+ * never hold dirty blocks
+ */
+START_TEST(write_back_test)
+{
+    int block_size = 4096;
+    char *fn = "/write-back.fil";
+    char expect[3 * block_size];
+    for (int i = 0; i < sizeof(expect); i += 16)
+    {
+        sprintf(expect + i, "write-back %04d", i / 16);
+    }
+
+    struct cache_stats before, after;
+    cache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write(fn, expect, sizeof(expect), 0, NULL), sizeof(expect));
+    cache_get_stats(&after);
+    if (cache_writing_back())
+    {
+        ck_assert_int_ge(after.dirty, 3);
+        for (int i = 0; i < 3; i++)
+        {
+            ck_assert(!on_disk(expect + i * block_size));
+        }
+    }
+    else
+    {
+        ck_assert_int_eq(after.dirty, 0);
+    }
+
+    ck_assert_int_eq(fs_ops.fsync(fn, 0, NULL), 0);
+    cache_get_stats(&after);
+    ck_assert_int_eq(after.dirty, 0);
+    if (cache_writing_back())
+    {
+        ck_assert_int_ge(after.writebacks - before.writebacks, 3);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        ck_assert(on_disk(expect + i * block_size));
+    }
+    ck_assert_int_eq(fs_ops.unlink(fn), 0);
+}
+END_TEST
+
+/* sequential reads through a handle double its read-ahead window up to
+ * the largest, a jump elsewhere collapses it, and a second handle on the
+ * same file has a window of its own
+ */
+START_TEST(readahead_window_test)
+{
+    int block_size = 4096;
+    int nblocks = 200;
+    char *fn = "/readahead.fil";
+    char *expect = malloc(nblocks * block_size), buf[block_size];
+    init_test_data(expect, nblocks * block_size, 251, -1);
+    ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write(fn, expect, nblocks * block_size, 0, NULL), nblocks * block_size);
+
+    struct fuse_file_info fi = {0}, fi2 = {0};
+    struct ra_stats ra, before;
+    ck_assert_int_eq(fs_ops.open(fn, &fi), 0);
+    ck_assert_int_eq(fs_ops.open(fn, &fi2), 0);
+    readahead_get_stats(&before);
+    ck_assert_int_eq(before.max_window, RA_DEFAULT_MAX);
+
+    int window = RA_MIN_WINDOW;
+    for (int blk = 0; blk < 6; blk++)
+    {
+        ck_assert_int_eq(fs_ops.read(fn, buf, block_size, blk * block_size, &fi), block_size);
+        ck_assert(memcmp(buf, expect + blk * block_size, block_size) == 0);
+        readahead_get_stats(&ra);
+        ck_assert_int_eq(ra.window, window);
+        window = (window * 2 > RA_DEFAULT_MAX) ? RA_DEFAULT_MAX : window * 2;
+    }
+    ck_assert_int_eq(ra.sequential - before.sequential, 5);
+    ck_assert_int_eq(ra.random - before.random, 1);
+    ck_assert_int_gt(ra.refills, before.refills);
+
+    // the second handle starts from the beginning, the first carries on
+    ck_assert_int_eq(fs_ops.read(fn, buf, block_size, 0, &fi2), block_size);
+    readahead_get_stats(&ra);
+    ck_assert_int_eq(ra.window, RA_MIN_WINDOW);
+    ck_assert_int_eq(fs_ops.read(fn, buf, block_size, 6 * block_size, &fi), block_size);
+    readahead_get_stats(&ra);
+    ck_assert_int_eq(ra.window, RA_DEFAULT_MAX);
+
+    // and a jump is not sequential
+    ck_assert_int_eq(fs_ops.read(fn, buf, block_size, 150 * block_size, &fi), block_size);
+    ck_assert(memcmp(buf, expect + 150 * block_size, block_size) == 0);
+    readahead_get_stats(&ra);
+    ck_assert_int_eq(ra.window, 0);
+
+    ck_assert_int_eq(fs_ops.release(fn, &fi), 0);
+    ck_assert_int_eq(fs_ops.release(fn, &fi2), 0);
+    ck_assert_int_eq(fs_ops.unlink(fn), 0);
+    free(expect);
+}
+END_TEST
+
+/* names looked up once are answered from the dentry cache, and rename,
+ * unlink and rmdir take the old names out of it
+ */
+START_TEST(dcache_invalidate_test)
+{
+    struct stat sb;
+    struct dcache_stats before, after;
+    ck_assert_int_eq(fs_ops.mkdir("/dc", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/dc/old", MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/dc/old", "12345", 5, 0, NULL), 5);
+    ck_assert_int_eq(fs_ops.getattr("/dc/old", &sb), 0);
+    dcache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.getattr("/dc/old", &sb), 0);
+    dcache_get_stats(&after);
+    ck_assert_int_eq(after.hits - before.hits, 2);
+    ck_assert_int_eq(after.misses, before.misses);
+
+    ck_assert_int_eq(fs_ops.rename("/dc/old", "/dc/new"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/old", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dc/new", &sb), 0);
+    ck_assert_int_eq(sb.st_size, 5);
+
+
+    ck_assert_int_eq(fs_ops.unlink("/dc/new"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/new", &sb), -ENOENT);
+
+    // a directory made again under the same name starts out empty
+    ck_assert_int_eq(fs_ops.create("/dc/inner", MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/inner", &sb), 0);
+    ck_assert_int_eq(fs_ops.unlink("/dc/inner"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/dc"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.mkdir("/dc", 0777), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/inner", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.rmdir("/dc"), 0);
+}
+END_TEST
+
+/* a name found to be absent is remembered, so looking it up again
+ * scans nothing; creating it under any of the ways a name appears
+ * replaces the negative entry
+ */
+START_TEST(dcache_negative_test)
+{
+    struct stat sb;
+    struct dcache_stats before, after;
+    ck_assert_int_eq(fs_ops.getattr("/absent", &sb), -ENOENT);
+    dcache_get_stats(&before);
+    ck_assert_int_gt(before.negative, 0);
+    ck_assert_int_eq(fs_ops.getattr("/absent", &sb), -ENOENT);
+    dcache_get_stats(&after);
+    ck_assert_int_eq(after.neg_hits - before.neg_hits, 1);
+    ck_assert_int_eq(after.misses, before.misses);
+
+    ck_assert_int_eq(fs_ops.create("/absent", MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/absent", &sb), 0);
+    ck_assert(S_ISREG(sb.st_mode));
+
+    ck_assert_int_eq(fs_ops.getattr("/absent-dir", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.mkdir("/absent-dir", 0777), 0);
+    ck_assert_int_eq(fs_ops.getattr("/absent-dir", &sb), 0);
+    ck_assert(S_ISDIR(sb.st_mode));
+
+    ck_assert_int_eq(fs_ops.getattr("/absent-dir/renamed", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/absent-dir/file", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.create("/absent-dir/file", MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.rename("/absent-dir/file", "/absent-dir/renamed"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/absent-dir/renamed", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/absent-dir/file", &sb), -ENOENT);
+
+    ck_assert_int_eq(fs_ops.unlink("/absent-dir/renamed"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/absent-dir"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/absent"), 0);
+}
+END_TEST
+
+/* with a write-back cache, chmod only marks the cached attributes
+ * dirty; they reach the inode block on icache_sync. Otherwise the
+ * inode block is updated straight away
+ */
+START_TEST(icache_writeback_test)
+{
+    char *fn = "/icache.fil";
+    struct stat sb;
+    struct fs_inode inode;
+    struct icache_stats before, after;
+    ck_assert_int_eq(fs_ops.create(fn, MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.fsync(fn, 0, NULL), 0);
+    int inum = path_to_inum(fn, 0);
+    ck_assert_int_gt(inum, 0);
+
+    icache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.chmod(fn, 0600), 0);
+    ck_assert_int_eq(fs_ops.getattr(fn, &sb), 0);
+    ck_assert_int_eq(sb.st_mode, MY_S_IFREG | 0600);
+    icache_get_stats(&after);
+    ck_assert_int_eq(cache_read(&inode, inum, 1), 0);
+    if (cache_writing_back())
+    {
+        ck_assert_int_eq(after.dirty, before.dirty + 1);
+        ck_assert_int_eq(inode.mode & ~FS_MODE_FLAGS, MY_S_IFREG | 0666);
+    }
+    else
+    {
+        ck_assert_int_eq(after.dirty, 0);
+        ck_assert_int_eq(inode.mode & ~FS_MODE_FLAGS, MY_S_IFREG | 0600);
+    }
+
+    ck_assert_int_eq(icache_sync(), 0);
+    icache_get_stats(&after);
+    ck_assert_int_eq(after.dirty, 0);
+    ck_assert_int_eq(cache_read(&inode, inum, 1), 0);
+    ck_assert_int_eq(inode.mode & ~FS_MODE_FLAGS, MY_S_IFREG | 0600);
+    if (cache_writing_back())
+    {
+        ck_assert_int_gt(after.writebacks, before.writebacks);
+    }
+    ck_assert_int_eq(fs_ops.unlink(fn), 0);
+}
+END_TEST
+
+/* paths have no depth limit: 24 levels of directories, also written
+ * with doubled and trailing slashes
+ */
+#define DEEP_LEVELS 24
+
+START_TEST(deep_path_test)
+{
+    char path[DEEP_LEVELS * 4 + 32], slashes[2 * sizeof(path)], buf[16];
+    struct stat sb;
+    int len = 0;
+    for (int i = 0; i < DEEP_LEVELS; i++)
+    {
+        len += sprintf(path + len, "/d%02d", i);
+        ck_assert_int_eq(fs_ops.mkdir(path, 0777), 0);
+    }
+    strcpy(path + len, "/file");
+    ck_assert_int_eq(fs_ops.create(path, MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write(path, "deep", 4, 0, NULL), 4);
+
+    int n = 0;
+    for (char *p = path; *p != 0; p++)
+    {
+        if (*p == '/')
+        {
+            slashes[n++] = '/';
+        }
+        slashes[n++] = *p;
+    }
+    strcpy(slashes + n, "/");
+    ck_assert_int_eq(fs_ops.getattr(slashes, &sb), 0);
+    ck_assert_int_eq(sb.st_size, 4);
+    ck_assert_int_eq(fs_ops.read(slashes, buf, sizeof(buf), 0, NULL), 4);
+    ck_assert(memcmp(buf, "deep", 4) == 0);
+
+    struct dir_test_data dir_data[] = {
+        {"file", 0, 0, 0},
+        {"", 0, 0, 0}};
+    path[len] = 0;
+    validate_directory(path, dir_data);
+
+    strcpy(path + len, "/file");
+    ck_assert_int_eq(fs_ops.unlink(path), 0);
+    for (int i = DEEP_LEVELS - 1; i >= 0; i--)
+    {
+        path[len] = 0;
+        ck_assert_int_eq(fs_ops.rmdir(path), 0);
+        len -= 4;
+    }
+    ck_assert_int_eq(fs_ops.getattr("/d00", &sb), -ENOENT);
+}
+END_TEST
+
+/* the directory entry index, and the vector scan used before a block is
+ * indexed, both give the same answers as strcmp over every entry: for
+ * names that are there, names that are not, prefixes and extensions of
+ * names that are there, and slots with junk after the name's NUL
+ */
+static int dirent_find(const struct fs_dirent *entries, const char *name, int *freeSlot)
+{
+    int slot = -1;
+    *freeSlot = -1;
+    for (int i = 0; i < 128; i++)
+    {
+        if (!entries[i].valid && *freeSlot < 0)
+        {
+            *freeSlot = i;
+        }
+        if (entries[i].valid && slot < 0 && strcmp(entries[i].name, name) == 0)
+        {
+            slot = i;
+        }
+    }
+    return slot;
+}
+
+START_TEST(dindex_scan_test)
+{
+    struct fs_dirent entries[128];
+    char names[3 * 128 + 1][28];
+    unsigned seed = 5600;
+    struct dindex_stats before, after;
+    dindex_get_stats(&before);
+
+    for (int lba = 1000000; lba < 1000016; lba++)
+    {
+        // each block fuller than the last; junk everywhere, then real names
+        for (int i = 0; i < sizeof(entries); i++)
+        {
+            ((char *)entries)[i] = rand_r(&seed);
+        }
+        int nvalid = (lba - 1000000) * 8 + 4;
+        for (int i = 0; i < 128; i++)
+        {
+            entries[i].valid = 0;
+        }
+        for (int n = 0; n < nvalid; n++)
+        {
+            int i = rand_r(&seed) % 128;
+            int len = 1 + rand_r(&seed) % 27;
+            entries[i].valid = 1;
+            for (int j = 0; j < len; j++)
+            {
+                entries[i].name[j] = 'a' + rand_r(&seed) % 3;
+            }
+            entries[i].name[len] = 0;
+        }
+
+        int nnames = 0;
+        for (int i = 0; i < 128; i++)
+        {
+            if (!entries[i].valid)
+            {
+                continue;
+            }
+            int len = strlen(entries[i].name);
+            strcpy(names[nnames++], entries[i].name);
+            strcpy(names[nnames], entries[i].name);
+            names[nnames++][len - 1] = 0;              // a prefix
+            if (len < 27)
+            {
+                sprintf(names[nnames++], "%sa", entries[i].name);  // an extension
+            }
+        }
+        strcpy(names[nnames++], "zzz");
+
+        // a block is only indexed the second time it is looked at, so
+        // the first pass forgets it before every lookup to keep scanning
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int n = 0; n < nnames; n++)
+            {
+                if (pass == 0)
+                {
+                    dindex_forget(lba);
+                }
+                int freeSlot, wantFree;
+                int want = dirent_find(entries, names[n], &wantFree);
+                int got = dindex_lookup(lba, entries, names[n], strlen(names[n]), &freeSlot);
+                ck_assert_int_eq(got, want);
+                ck_assert_int_eq(freeSlot, wantFree);
+            }
+        }
+        dindex_forget(lba);
+    }
+    dindex_get_stats(&after);
+    ck_assert_int_gt(after.scanned, before.scanned);
+    ck_assert_int_gt(after.indexed, before.indexed);
+    ck_assert_int_eq(after.builds - before.builds, 16);
+}
+END_TEST
+
+/* the allocator's free count and free extents agree with the bitmap
+ * block (copied to 'bitmap') counted bit by bit
+ */
+static void bitmap_check(unsigned char *bitmap)
+{
+    struct balloc_stats st;
+    ck_assert_int_eq(cache_read(bitmap, 1, 1), 0);
+    balloc_get_stats(&st);
+    int nfree = 0, runs = 0, longest = 0, run = 0;
+    for (int b = 0; b < 400; b++)
+    {
+        if (bitmap[b / 8] & (1 << (b % 8)))
+        {
+            run = 0;
+            continue;
+        }
+        nfree++;
+        runs += (run++ == 0);
+        longest = (run > longest) ? run : longest;
+    }
+    ck_assert_int_eq(st.free, nfree);
+    ck_assert_int_eq(st.reserved, 0);
+    ck_assert_int_eq(st.free_extents, runs);
+    ck_assert_int_eq(st.largest_free, longest);
+}
+
+/* allocations through a mix of sizes and frees that leaves holes of
+ * every length: each block handed out was free, none twice, and the
+ * extent index tracks the bitmap throughout
+ */
+START_TEST(balloc_bitmap_test)
+{
+    unsigned char bitmap[4096];
+    int blocks[200], nblocks = 0;
+    bitmap_check(bitmap);
+    int free_before = balloc_free_count();
+
+    for (int n = 1; n <= 12; n++)
+    {
+        int *got = blocks + nblocks;
+        ck_assert_int_eq(balloc_alloc(-1, n, got), 0);
+        for (int i = 0; i < n; i++)
+        {
+            ck_assert_int_eq(bitmap[got[i] / 8] & (1 << (got[i] % 8)), 0);
+            for (int j = 0; j < nblocks + i; j++)
+            {
+                ck_assert_int_ne(blocks[j], got[i]);
+            }
+        }
+        nblocks += n;
+        bitmap_check(bitmap);
+    }
+    ck_assert_int_eq(balloc_free_count(), free_before - nblocks);
+
+    // free every third block, then fill the holes with single blocks
+    int holes[200], nholes = 0;
+    for (int i = 0; i < nblocks; i += 3)
+    {
+        holes[nholes++] = blocks[i];
+    }
+    ck_assert_int_eq(balloc_free(holes, nholes), 0);
+    bitmap_check(bitmap);
+    for (int i = 0; i < nholes; i++)
+    {
+        ck_assert_int_eq(balloc_alloc(holes[i], 1, &holes[i]), 0);
+        ck_assert_int_eq(holes[i], blocks[i * 3]);
+    }
+    bitmap_check(bitmap);
+
+    ck_assert_int_eq(balloc_free(blocks, nblocks), 0);
+    bitmap_check(bitmap);
+    ck_assert_int_eq(balloc_free_count(), free_before);
+}
+END_TEST
+
+/* number of contiguous runs the file's blocks are in
+ */
+static int file_runs(const char *path)
+{
+    struct fs_inode inode;
+    int inum = path_to_inum(path, 0);
+    ck_assert_int_gt(inum, 0);
+    ck_assert_int_eq(cache_read(&inode, inum, 1), 0);
+    int runs = 0;
+    uint32_t next = 0;
+    if (inode.mode & FS_INODE_EXTENTS)
+    {
+        for (int i = 0; i < inode.nextents; i++)
+        {
+            runs += (inode.extents[i].start != next);
+            next = inode.extents[i].start + inode.extents[i].len;
+        }
+        return runs;
+    }
+    for (int i = 0; i < (inode.size + 4095) / 4096; i++)
+    {
+        runs += (inode.ptrs[i] != next);
+        next = inode.ptrs[i] + 1;
+    }
+    return runs;
+}
+
+/* two files appended to in turn each fill a reservation window of their
+ * own, so they stay contiguous (16 blocks fit in the first window) and
+ * every append after the first lands at its goal. Removing them leaves
+ * free space as unfragmented as it was
+ */
+START_TEST(placement_test)
+{
+    int block_size = 4096;
+    int nblocks = 16;
+    char buf[block_size];
+    memset(buf, 'p', block_size);
+    struct balloc_stats before, after;
+    balloc_get_stats(&before);
+
+    ck_assert_int_eq(fs_ops.create("/place.a", MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/place.b", MY_S_IFREG | 0666, NULL), 0);
+    struct balloc_stats created;
+    balloc_get_stats(&created);
+    for (int i = 0; i < nblocks; i++)
+    {
+        ck_assert_int_eq(fs_ops.write("/place.a", buf, block_size, i * block_size, NULL), block_size);
+        ck_assert_int_eq(fs_ops.write("/place.b", buf, block_size, i * block_size, NULL), block_size);
+    }
+    balloc_get_stats(&after);
+    ck_assert_int_eq(file_runs("/place.a"), 1);
+    ck_assert_int_eq(file_runs("/place.b"), 1);
+    ck_assert_int_ge(after.goal_hits - created.goal_hits, 2 * (nblocks - 1));
+    ck_assert_int_eq(after.allocs - created.allocs, 2 * nblocks);
+
+    ck_assert_int_eq(fs_ops.unlink("/place.a"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/place.b"), 0);
+    balloc_get_stats(&after);
+    ck_assert_int_eq(after.free, before.free);
+    ck_assert_int_eq(after.reserved, before.reserved);
+    ck_assert_int_eq(after.free_extents, before.free_extents);
+    ck_assert_int_eq(after.largest_free, before.largest_free);
+}
+END_TEST
+
 int main(int argc, char **argv)
 {
     system("python2 gen-disk.py -q disk2.in test2.img");
+    // optional: the block backend, and "writeback" for a write-back
+    // cache; "make check" runs the combinations
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "writeback") == 0)
+        {
+            cache_writeback(1);
+        }
+        else if (block_backend(argv[i]) < 0)
+        {
+            printf("usage: %s [pread|mmap|uring] [writeback]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
     block_init("test2.img");
     fs_ops.init(NULL);
 
@@ -592,6 +1364,18 @@ int main(int argc, char **argv)
     tcase_add_test(tc, write_overwrite_test);
     tcase_add_test(tc, write_truncate_test);
     tcase_add_test(tc, write_append_test);            /* as above, ensure blocks are freed appropriately */
+    tcase_add_test(tc, dir_index_full_disk_test);
+    tcase_add_test(tc, write_gather_test);            /* appends through an open file */
+    tcase_add_test(tc, write_gather_error_test);
+    tcase_add_test(tc, write_back_test);
+    tcase_add_test(tc, readahead_window_test);
+    tcase_add_test(tc, dcache_invalidate_test);
+    tcase_add_test(tc, dcache_negative_test);
+    tcase_add_test(tc, icache_writeback_test);
+    tcase_add_test(tc, deep_path_test);
+    tcase_add_test(tc, dindex_scan_test);
+    tcase_add_test(tc, balloc_bitmap_test);
+    tcase_add_test(tc, placement_test);
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);
@@ -0,0 +1,458 @@
+/*
+ * file:        unittest-3.c
+ * description: libcheck tests, part 3 - a large image (disk3.in) with
+ *              64 KB blocks and more than one bitmap group
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <zlib.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "fs5600.h"
+#include "balloc.h"
+#include "cache.h"
+
+// vscode issue
+#define MY_S_IFREG 0100000
+
+#define BLOCK_SIZE 65536        // from disk3.in
+#define DISK_BLOCKS 40000
+
+struct fuse_context ctx = {.uid = 500, .gid = 500};
+struct fuse_context *fuse_get_context(void)
+{
+    return &ctx;
+}
+
+extern struct fuse_operations fs_ops;
+extern void block_init(char *file);
+
+/* the image has two groups; the second holds /far.file (inode 32800,
+ * blocks 32801-32802) and its own bitmap block, 32768. Nothing there is
+ * loaded until something is freed or allocated in it.
+ */
+START_TEST(multi_group_test)
+{
+    struct statvfs fsstats;
+    struct balloc_stats bst;
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bsize, BLOCK_SIZE);
+    ck_assert_int_eq(fsstats.f_blocks, DISK_BLOCKS - 2);
+    // superblock, bitmap, root inode and block, group 1 bitmap, far.file
+    ck_assert_int_eq(fsstats.f_bfree, DISK_BLOCKS - 8);
+    balloc_get_stats(&bst);
+    ck_assert_int_eq(bst.groups, 2);
+    ck_assert_int_eq(bst.groups_loaded, 0);
+
+    char buf[1000];
+    struct stat sb;
+    ck_assert_int_eq(fs_ops.getattr("/far.file", &sb), 0);
+    ck_assert_int_eq(sb.st_size, 70000);
+    ck_assert_int_eq(fs_ops.read("/far.file", buf, sizeof(buf), BLOCK_SIZE, NULL), sizeof(buf));
+
+    ck_assert_int_eq(fs_ops.unlink("/far.file"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bfree, DISK_BLOCKS - 5);
+    balloc_get_stats(&bst);
+    ck_assert_int_eq(bst.groups_loaded, 1);
+}
+END_TEST
+
+/* a directory far past one block: it is converted to an indexed one
+ * after 128 entries and then split leaf by leaf
+ */
+#define BIG_DIR_FILES 3000
+
+START_TEST(big_dir_test)
+{
+    struct statvfs fsstats;
+    struct stat sb;
+    char name[64];
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int free_blocks = fsstats.f_bfree;
+
+    ck_assert_int_eq(fs_ops.mkdir("/big", 0777), 0);
+    for (int i = 0; i < BIG_DIR_FILES; i++)
+    {
+        sprintf(name, "/big/file-%04d", i);
+        ck_assert_int_eq(fs_ops.create(name, MY_S_IFREG | 0666, NULL), 0);
+    }
+    ck_assert_int_eq(fs_ops.create("/big/file-0042", MY_S_IFREG | 0666, NULL), -EEXIST);
+    for (int i = 0; i < BIG_DIR_FILES; i++)
+    {
+        sprintf(name, "/big/file-%04d", i);
+        ck_assert_int_eq(fs_ops.getattr(name, &sb), 0);
+        ck_assert(S_ISREG(sb.st_mode));
+    }
+    ck_assert_int_eq(fs_ops.getattr("/big/file-9999", &sb), -ENOENT);
+
+    // rename within the directory, to names that land in other leaves
+    for (int i = 0; i < BIG_DIR_FILES; i += 10)
+    {
+        char newname[64];
+        sprintf(name, "/big/file-%04d", i);
+        sprintf(newname, "/big/renamed-%d", i);
+        ck_assert_int_eq(fs_ops.rename(name, newname), 0);
+        ck_assert_int_eq(fs_ops.getattr(name, &sb), -ENOENT);
+        ck_assert_int_eq(fs_ops.getattr(newname, &sb), 0);
+    }
+
+    // unlink every other entry, then look everything up again
+    for (int i = 1; i < BIG_DIR_FILES; i += 2)
+    {
+        sprintf(name, (i % 10 == 0) ? "/big/renamed-%d" : "/big/file-%04d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/big"), -ENOTEMPTY);
+    for (int i = 0; i < BIG_DIR_FILES; i++)
+    {
+        sprintf(name, (i % 10 == 0) ? "/big/renamed-%d" : "/big/file-%04d", i);
+        ck_assert_int_eq(fs_ops.getattr(name, &sb), (i % 2) ? -ENOENT : 0);
+    }
+
+    // and the freed slots are used again
+    for (int i = 1; i < BIG_DIR_FILES; i += 2)
+    {
+        sprintf(name, "/big/again-%d", i);
+        ck_assert_int_eq(fs_ops.create(name, MY_S_IFREG | 0666, NULL), 0);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+
+    for (int i = 0; i < BIG_DIR_FILES; i += 2)
+    {
+        sprintf(name, (i % 10 == 0) ? "/big/renamed-%d" : "/big/file-%04d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bfree, free_blocks);
+}
+END_TEST
+
+/* readdir in small batches, the way FUSE calls it when its buffer
+ * fills: the filler refuses an entry by returning 1, and the next call
+ * resumes from the offset of the last entry it took.
+ */
+#define LIST_FILES 300
+#define LIST_BATCH 7
+#define LIST_ADDED 1024
+
+struct list_batch
+{
+    int taken;              // entries accepted by this call
+    int full;               // the filler refused one
+    off_t next;             // offset to resume from
+    int seen[LIST_FILES];
+    int added[LIST_ADDED];  // n-<i>, created during the listing
+    int unexpected;
+};
+
+int list_filler(void *ptr, const char *name, const struct stat *st, off_t off)
+{
+    struct list_batch *lb = (struct list_batch *)ptr;
+    int i;
+    if (lb->taken == LIST_BATCH)
+    {
+        lb->full = 1;
+        return 1;
+    }
+    lb->taken++;
+    lb->next = off;
+    if (sscanf(name, "e-%d", &i) == 1 && i >= 0 && i < LIST_FILES)
+    {
+        lb->seen[i]++;
+    }
+    else if (sscanf(name, "n-%d", &i) == 1 && i >= 0 && i < LIST_ADDED)
+    {
+        lb->added[i]++;
+    }
+    else
+    {
+        lb->unexpected++;
+    }
+    return 0;
+}
+
+/* list 'dir' LIST_BATCH entries at a time, checking that names
+ * e-<i> with want(i) come back exactly once and nothing else does.
+ * With 'grow', that many new names n-<i> are created between calls,
+ * splitting leaves and moving entries; those may or may not be listed,
+ * but never twice. Returns how many were created.
+ */
+int list_in_batches(const char *dir, int (*want)(int), int grow)
+{
+    static struct list_batch lb;
+    char name[64];
+    int calls = 0, created = 0;
+    memset(&lb, 0, sizeof(lb));
+    do
+    {
+        lb.taken = lb.full = 0;
+        ck_assert_int_eq(fs_ops.readdir(dir, &lb, list_filler, lb.next, NULL), 0);
+        ck_assert(++calls < 2 * LIST_FILES);
+        for (int i = 0; i < grow && created < LIST_ADDED; i++)
+        {
+            sprintf(name, "%s/n-%d", dir, created++);
+            ck_assert_int_eq(fs_ops.create(name, MY_S_IFREG | 0666, NULL), 0);
+        }
+    } while (lb.full);
+    for (int i = 0; i < LIST_FILES; i++)
+    {
+        ck_assert_int_eq(lb.seen[i], want(i) ? 1 : 0);
+    }
+    for (int i = 0; i < LIST_ADDED; i++)
+    {
+        ck_assert_int_le(lb.added[i], 1);
+    }
+    ck_assert_int_eq(lb.unexpected, 0);
+    return created;
+}
+
+int want_all(int i)
+{
+    return 1;
+}
+
+int want_odd(int i)
+{
+    return i % 2;
+}
+
+START_TEST(readdir_batch_test)
+{
+    char name[64];
+    ck_assert_int_eq(fs_ops.mkdir("/list", 0777), 0);
+    for (int i = 0; i < LIST_FILES; i++)
+    {
+        sprintf(name, "/list/e-%d", i);
+        ck_assert_int_eq(fs_ops.create(name, MY_S_IFREG | 0666, NULL), 0);
+    }
+    list_in_batches("/list", want_all, 0);
+
+    // creates between the calls split leaves under the listing
+    int created = list_in_batches("/list", want_all, LIST_BATCH);
+    for (int i = 0; i < created; i++)
+    {
+        sprintf(name, "/list/n-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+
+    // holes in every entry block
+    for (int i = 0; i < LIST_FILES; i += 2)
+    {
+        sprintf(name, "/list/e-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    list_in_batches("/list", want_odd, 0);
+
+    for (int i = 1; i < LIST_FILES; i += 2)
+    {
+        sprintf(name, "/list/e-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/list"), 0);
+}
+END_TEST
+
+/* a file longer than an inode's 1019 block pointers, so that it is
+ * kept as extents, and then offsets past 2^31 and 2^32
+ */
+#define LARGE_BLOCKS 1100
+#define LARGE_CHUNK (1 << 20)
+
+unsigned char large_byte(off_t off)
+{
+    return (off ^ (off >> 11) ^ (off >> 23)) & 0xff;
+}
+
+void large_fill(char *buf, int len, off_t off)
+{
+    for (int i = 0; i < len; i++)
+        buf[i] = large_byte(off + i);
+}
+
+/* read 'len' bytes at 'off' and compare them with the pattern, or with
+ * zeros if 'hole'
+ */
+void large_check(const char *path, char *buf, int len, off_t off, int hole)
+{
+    ck_assert_int_eq(fs_ops.read(path, buf, len, off, NULL), len);
+    for (int i = 0; i < len; i++)
+        ck_assert_int_eq((unsigned char)buf[i], hole ? 0 : large_byte(off + i));
+}
+
+START_TEST(large_file_test)
+{
+    struct statvfs fsstats;
+    struct stat sb;
+    char *buf = malloc(LARGE_CHUNK);
+    off_t size = (off_t)LARGE_BLOCKS * BLOCK_SIZE;
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int free_blocks = fsstats.f_bfree;
+
+    ck_assert_int_eq(fs_ops.create("/large", MY_S_IFREG | 0666, NULL), 0);
+    for (off_t off = 0; off < size; off += LARGE_CHUNK)
+    {
+        int len = (size - off < LARGE_CHUNK) ? size - off : LARGE_CHUNK;
+        large_fill(buf, len, off);
+        ck_assert_int_eq(fs_ops.write("/large", buf, len, off, NULL), len);
+    }
+    ck_assert_int_eq(fs_ops.getattr("/large", &sb), 0);
+    ck_assert_int_eq(sb.st_size, size);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_le(fsstats.f_bfree, free_blocks - 1 - LARGE_BLOCKS);
+    for (off_t off = 0; off < size; off += LARGE_CHUNK)
+    {
+        int len = (size - off < LARGE_CHUNK) ? size - off : LARGE_CHUNK;
+        large_check("/large", buf, len, off, 0);
+    }
+    // a read bigger than the block cache is not cached: the first 64
+    // blocks were pushed out long ago, and all of them come from disk
+    struct cache_stats cst, cst2;
+    char *whole = malloc(64 * BLOCK_SIZE);
+    cache_get_stats(&cst);
+    large_check("/large", whole, 64 * BLOCK_SIZE, 0, 0);
+    cache_get_stats(&cst2);
+    if (cst.budget > 0)
+    {
+        ck_assert_int_eq(cst2.bypassed - cst.bypassed, 64);
+        ck_assert_int_eq(cst2.misses - cst.misses, 64);
+    }
+    free(whole);
+
+    // across the 1019th block, and over the end of the file
+    large_check("/large", buf, 3 * BLOCK_SIZE, 1017L * BLOCK_SIZE + 100, 0);
+    ck_assert_int_eq(fs_ops.read("/large", buf, 1000, size - 500, NULL), 500);
+
+    // truncate into the middle of a block, then grow back over a hole
+    off_t cut = 600L * BLOCK_SIZE + 1234;
+    ck_assert_int_eq(fs_ops.truncate("/large", cut), 0);
+    ck_assert_int_eq(fs_ops.getattr("/large", &sb), 0);
+    ck_assert_int_eq(sb.st_size, cut);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_le(fsstats.f_bfree, free_blocks - 1 - 601);
+    ck_assert_int_ge(fsstats.f_bfree, free_blocks - 1 - 601 - 2);
+    large_check("/large", buf, 1234, cut - 1234, 0);
+    ck_assert_int_eq(fs_ops.read("/large", buf, 100, cut, NULL), 0);
+    ck_assert_int_eq(fs_ops.truncate("/large", size), 0);
+    large_check("/large", buf, 1000, cut - 1000, 0);
+    large_check("/large", buf, BLOCK_SIZE, cut, 1);
+    large_check("/large", buf, BLOCK_SIZE, size - BLOCK_SIZE, 1);
+
+    // sparse writes past 2^31 and 2^32 allocate only what they touch
+    off_t far1 = (3L << 30) + 1000, far2 = (5L << 30) + BLOCK_SIZE - 100;
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    int before = fsstats.f_bfree;
+    large_fill(buf, 5000, far1);
+    ck_assert_int_eq(fs_ops.write("/large", buf, 5000, far1, NULL), 5000);
+    large_fill(buf, 5000, far2);
+    ck_assert_int_eq(fs_ops.write("/large", buf, 5000, far2, NULL), 5000);
+    ck_assert_int_eq(fs_ops.getattr("/large", &sb), 0);
+    ck_assert_int_eq(sb.st_size, far2 + 5000);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_le(fsstats.f_bfree, before - 3);
+    ck_assert_int_ge(fsstats.f_bfree, before - 3 - 2);
+    large_check("/large", buf, 5000, far1, 0);
+    large_check("/large", buf, 5000, far2, 0);
+    large_check("/large", buf, 1000, 1L << 31, 1);
+    large_check("/large", buf, 1000, 1L << 32, 1);
+    large_check("/large", buf, 1000, 600L * BLOCK_SIZE, 0);
+
+    // truncate between the two, past 2^32
+    off_t cut2 = (1L << 32) + 10;
+    ck_assert_int_eq(fs_ops.truncate("/large", cut2), 0);
+    ck_assert_int_eq(fs_ops.getattr("/large", &sb), 0);
+    ck_assert_int_eq(sb.st_size, cut2);
+    ck_assert_int_eq(fs_ops.read("/large", buf, 100, cut2 - 10, NULL), 10);
+    large_check("/large", buf, 5000, far1, 0);
+
+    ck_assert_int_eq(fs_ops.unlink("/large"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &fsstats), 0);
+    ck_assert_int_eq(fsstats.f_bfree, free_blocks);
+    free(buf);
+}
+END_TEST
+
+/* the free counts after a remount: taken from the superblock after a
+ * clean unmount, and counted from the bitmaps when the last mount never
+ * unmounted
+ */
+START_TEST(remount_test)
+{
+    struct statvfs before, after;
+    struct balloc_stats bst;
+    char buf[5000];
+    large_fill(buf, sizeof(buf), 3L * BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.create("/kept", MY_S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/kept", buf, sizeof(buf), 3L * BLOCK_SIZE, NULL), sizeof(buf));
+    ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+
+    fs_ops.destroy(NULL);
+    ck_assert(fs_ops.init(NULL) == NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+    balloc_get_stats(&bst);
+    ck_assert_int_eq(bst.groups_counted, 0);
+
+    // the image is marked in use again, so without an unmount the next
+    // mount has to count
+    ck_assert(fs_ops.init(NULL) == NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+    balloc_get_stats(&bst);
+    ck_assert_int_eq(bst.groups_counted, 2);
+
+    large_check("/kept", buf, sizeof(buf), 3L * BLOCK_SIZE, 0);
+    ck_assert_int_eq(fs_ops.unlink("/kept"), 0);
+}
+END_TEST
+
+int main(int argc, char **argv)
+{
+    system("python2 gen-disk.py -q disk3.in test3.img");
+    // optional: the block backend, and "writeback" for a write-back
+    // cache; "make check" runs the combinations
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "writeback") == 0)
+        {
+            cache_writeback(1);
+        }
+        else if (block_backend(argv[i]) < 0)
+        {
+            printf("usage: %s [pread|mmap|uring] [writeback]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    block_init("test3.img");
+    fs_ops.init(NULL);
+
+    Suite *s = suite_create("fs5600");
+    TCase *tc = tcase_create("large_image");
+    tcase_set_timeout(tc, 60);
+
+    tcase_add_test(tc, multi_group_test);   /* must run first, on the fresh image */
+    tcase_add_test(tc, big_dir_test);
+    tcase_add_test(tc, readdir_batch_test);
+    tcase_add_test(tc, large_file_test);
+    tcase_add_test(tc, remount_test);
+
+    suite_add_tcase(s, tc);
+    SRunner *sr = srunner_create(s);
+    srunner_set_fork_status(sr, CK_NOFORK);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    int n_failed = srunner_ntests_failed(sr);
+    printf("%d tests failed\n", n_failed);
+
+    srunner_free(sr);
+    return (n_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
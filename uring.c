@@ -0,0 +1,288 @@
+/*
+ * file:        uring.c
+ * description: io_uring engine for the block layer in misc.c
+ *
+ * Talks to the kernel through the raw io_uring_setup/io_uring_enter
+ * system calls, so there is no dependency on liburing. A vectored
+ * request is turned into one READV/WRITEV submission per run of
+ * consecutive LBAs, and all of a request's runs are handed to the kernel
+ * with a single io_uring_enter call.
+ *
+ * ring.lock protects the rings and the requests' counts, but is not
+ * held while a thread sleeps in the kernel waiting for completions, so
+ * other threads can keep submitting. Only that one thread reaps; the
+ * rest wait for it on ring.reaped.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "misc.h"
+
+#define URING_ENTRIES 64
+
+/* one READV/WRITEV in flight; user_data of its SQE points here
+ */
+struct uring_run {
+    struct block_req *req;
+    ssize_t len;
+};
+
+static struct {
+    int fd;
+    int disk_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, cq_entries;
+    unsigned queued;		/* filled in SQ ring, not yet submitted */
+    unsigned inflight;		/* submitted, completion not yet reaped */
+    int reaping;		/* a thread is waiting in the kernel */
+    pthread_mutex_t lock;
+    pthread_cond_t reaped;	/* ... and has reaped what it found */
+} ring = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+          .reaped = PTHREAD_COND_INITIALIZER};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+/* create the ring and map its queues. Returns 0, or -errno if io_uring
+ * is not available (old kernel, seccomp, ...)
+ */
+int uring_setup(int disk_fd)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (fd < 0)
+        return -errno;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto fail;
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto fail;
+
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_entries = p.cq_entries;
+    ring.disk_fd = disk_fd;
+    ring.fd = fd;
+    return 0;
+
+fail:
+    close(fd);
+    return -ENOMEM;
+}
+
+/* hand everything queued in the SQ ring to the kernel
+ */
+static int ring_flush(void)
+{
+    while (ring.queued > 0) {
+        int val = sys_io_uring_enter(ring.queued, 0, 0);
+        if (val < 0) {
+            if (errno == EINTR)
+                continue;
+            return -EIO;
+        }
+        ring.queued -= val;
+        ring.inflight += val;
+    }
+    return 0;
+}
+
+/* consume all available completions, crediting them to their requests
+ */
+static void ring_reap(void)
+{
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct uring_run *run = (struct uring_run *)(uintptr_t)cqe->user_data;
+        if (cqe->res != run->len)
+            run->req->status = -EIO;
+        run->req->pending--;
+        ring.inflight--;
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit what is queued and block until completions have been reaped -
+ * by this thread, which drops ring.lock while it sleeps in the kernel,
+ * or by the one already doing so. Callers re-check what they wait for.
+ */
+static int ring_wait(void)
+{
+    int val;
+    if ((val = ring_flush()) < 0)
+        return val;
+    if (ring.reaping) {
+        pthread_cond_wait(&ring.reaped, &ring.lock);
+        return 0;
+    }
+    ring.reaping = 1;
+    pthread_mutex_unlock(&ring.lock);
+    while ((val = sys_io_uring_enter(0, 1, IORING_ENTER_GETEVENTS)) < 0 &&
+           errno == EINTR)
+        ;
+    pthread_mutex_lock(&ring.lock);
+    ring.reaping = 0;
+    ring_reap();
+    pthread_cond_broadcast(&ring.reaped);
+    return (val < 0) ? -EIO : 0;
+}
+
+/* queue one READV/WRITEV covering 'cnt' consecutive blocks
+ */
+static int ring_queue(struct uring_run *run, struct iovec *vec, int cnt,
+                      int lba, int write)
+{
+    int val;
+
+    /* never let completions outrun the CQ ring */
+    while (ring.queued + ring.inflight >= ring.cq_entries ||
+           ring.queued >= ring.sq_entries) {
+        if ((val = ring_wait()) < 0)
+            return val;
+    }
+
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = ring.disk_fd;
+    sqe->addr = (uintptr_t)vec;
+    sqe->len = cnt;
+    sqe->off = (uint64_t)lba << fs_block_shift;
+    sqe->user_data = (uintptr_t)run;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return 0;
+}
+
+/* start a request: queue one entry per run of consecutive LBAs and
+ * submit them all together. The iovec and run tables live until
+ * uring_wait_req() retires the request.
+ */
+int uring_submit(struct block_req *req)
+{
+    int n = req->n, val = 0;
+    char *mem = malloc(n * (sizeof(struct iovec) + sizeof(struct uring_run)));
+
+    req->priv = mem;
+    req->pending = 0;
+    req->status = 0;
+    if (mem == NULL)
+        return req->status = -ENOMEM;
+
+    struct iovec *vec = (struct iovec *)mem;
+    struct uring_run *runs = (struct uring_run *)(vec + n);
+
+    pthread_mutex_lock(&ring.lock);
+    for (int i = 0, r = 0; i < n; r++) {
+        int lba = req->iov[i].lba, start = i, cnt = 0;
+        while (i < n && cnt < IOV_MAX && req->iov[i].lba == lba + cnt) {
+            vec[i].iov_base = req->iov[i].buf;
+            vec[i].iov_len = fs_block_size;
+            cnt++, i++;
+        }
+        runs[r].req = req;
+        runs[r].len = (ssize_t)cnt << fs_block_shift;
+        if ((val = ring_queue(&runs[r], &vec[start], cnt, lba, req->write)) < 0)
+            break;
+        req->pending++;
+    }
+    if (val == 0)
+        val = ring_flush();
+    if (val < 0) {
+        /* the runs already queued point into req->priv: see them
+         * through before anything is freed, or leak it if we can't */
+        while (req->pending > 0) {
+            if (ring_wait() < 0) {
+                req->priv = NULL;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ring.lock);
+
+    if (val < 0)
+        req->status = val;
+    return val;
+}
+
+/* wait for every run of 'req' to complete; see ring_wait. Completions
+ * belonging to other requests are credited to them along the way.
+ */
+int uring_wait_req(struct block_req *req)
+{
+    pthread_mutex_lock(&ring.lock);
+    if (!ring.reaping)
+        ring_reap();
+    while (req->pending > 0) {
+        if (ring_wait() < 0) {
+            /* the kernel may still own our iovecs - leak them */
+            pthread_mutex_unlock(&ring.lock);
+            req->priv = NULL;
+            return req->status = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&ring.lock);
+
+    free(req->priv);
+    req->priv = NULL;
+    return req->status;
+}